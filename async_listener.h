@@ -0,0 +1,132 @@
+#ifndef __ASYNC_LISTENER_H__
+#define __ASYNC_LISTENER_H__
+
+#include "message_queue.h"
+#include "listener.h"
+
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+/* Worker threads which run AsyncListener deliveries.
+ */
+class ListenerPool
+{
+    boost::asio::io_service                            m_IOService;
+    boost::scoped_ptr< boost::asio::io_service::work > m_Work;
+    boost::thread_group                                m_Threads;
+
+    ListenerPool( const ListenerPool& );
+    ListenerPool& operator=( const ListenerPool& );
+public:
+    // threads == 0: one per core
+    ListenerPool( size_t threads = 0 )
+        : m_Work( new boost::asio::io_service::work( m_IOService ) )
+    {
+        if ( threads == 0 ) threads = std::max( 1u, boost::thread::hardware_concurrency() );
+        for ( size_t i = 0; i < threads; ++i ) {
+            m_Threads.create_thread( boost::bind( &boost::asio::io_service::run, &m_IOService ) );
+        }
+    }
+
+    ~ListenerPool()
+    {
+        Stop();
+    }
+
+    template<typename Handler>
+    void Post( const Handler& handler )
+    {
+        m_IOService.post( handler );
+    }
+
+    // finishes what is queued, then joins the workers
+    void Stop()
+    {
+        m_Work.reset();
+        m_Threads.join_all();
+    }
+};
+
+/* Delivers to another listener through a bounded mailbox, drained on a ListenerPool, so
+ * the sequencer's message thread never waits on the target's OnEvent(). Deliveries to one
+ * target are never concurrent and keep their order; a scheduled flag makes sure only one
+ * worker drains a mailbox at a time. What happens when the mailbox is full is up to its
+ * overflow policy, don't pick OVERFLOW_BLOCK unless a stalled dispatch is acceptable.
+ * Must be owned by a shared_ptr, the pool keeps it alive while a drain is queued.
+ */
+class AsyncListener : public Listener, public boost::enable_shared_from_this< AsyncListener >
+{
+public:
+    enum { DefaultCapacity = 256, MaxBatchSize = 64 };
+
+private:
+    ListenerPtr          m_Target;
+    ListenerPool*        m_Pool;
+    MessageQueue         m_Mailbox;
+    boost::atomic<bool>  m_Scheduled;
+
+public:
+    // the pool has to outlive the listener's registration
+    AsyncListener( const ListenerPtr& target, ListenerPool& pool, size_t capacity = DefaultCapacity,
+                   MessageQueue::OverflowPolicy policy = MessageQueue::OVERFLOW_DROP_OLDEST )
+        : m_Target(target)
+        , m_Pool(&pool)
+        , m_Mailbox( capacity, policy )
+        , m_Scheduled(false)
+    {
+    }
+
+    virtual ~AsyncListener() {}
+
+    virtual bool GetEventKey( MessageKey& key ) const
+    {
+        return m_Target->GetEventKey( key );
+    }
+
+    // called from sequencer message thread
+    virtual bool OnEvent( const MessagePtr& msg )
+    {
+        bool sent = m_Mailbox.Send( msg );
+        Schedule();
+        return sent;
+    }
+
+    const ListenerPtr& GetTarget() const
+    {
+        return m_Target;
+    }
+
+    // e.g. for its drop counters
+    const MessageQueue& GetMailbox() const
+    {
+        return m_Mailbox;
+    }
+
+protected:
+    void Schedule()
+    {
+        if ( !m_Scheduled.exchange( true, boost::memory_order_acq_rel ) ) {
+            m_Pool->Post( boost::bind( &AsyncListener::Drain, shared_from_this() ) );
+        }
+    }
+
+    // worker thread
+    void Drain()
+    {
+        MessagePtr msg;
+        for ( size_t i = 0; i < MaxBatchSize && ( msg = m_Mailbox.Poll() ); ++i ) {
+            m_Target->OnEvent( msg );
+        }
+        m_Scheduled.store( false, boost::memory_order_release );
+        // pairs with the fence in MessageQueue::Send(), a message sent meanwhile is seen here
+        boost::atomic_thread_fence( boost::memory_order_seq_cst );
+        // yield to other mailboxes after a batch
+        if ( !m_Mailbox.IsEmpty() ) Schedule();
+    }
+};
+
+#endif /* __ASYNC_LISTENER_H__ */
@@ -0,0 +1,392 @@
+/*
+ * benchmark.cpp
+ *
+ * Standalone benchmark, not part of the Sequencer executable. Build from this folder with e.g.
+ *
+ *   g++ -O2 -I.. benchmark.cpp -o benchmark -lboost_thread -lboost_system -lboost_chrono -lpthread
+ *
+ * and run "benchmark [result.json]". Results are written as JSON (to stdout if no file is given)
+ * so they can be compared between versions.
+ */
+
+#include "message_queue.h"
+#include "listener.h"
+#include "sequencer.h"
+#include "sequence_timed_effect.h"
+#include "effect_table.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/chrono.hpp>
+#include <boost/lexical_cast.hpp>
+
+typedef boost::chrono::steady_clock Clock;
+
+static boost::int64_t NowNs()
+{
+    return boost::chrono::duration_cast< boost::chrono::nanoseconds >( Clock::now().time_since_epoch() ).count();
+}
+
+static double Percentile( std::vector< double >& samples, double p )
+{
+    if ( samples.empty() ) return 0.0;
+    size_t index = (size_t)( p / 100.0 * ( samples.size() - 1 ) + 0.5 );
+    std::nth_element( samples.begin(), samples.begin() + index, samples.end() );
+    return samples[index];
+}
+
+// collects the JSON result objects
+class Report
+{
+    std::vector< std::string > m_Results;
+    std::string                m_Current;
+public:
+    void Begin( const char* name )
+    {
+        m_Current = std::string("{ \"name\": \"") + name + "\"";
+    }
+
+    void Add( const char* key, double value )
+    {
+        char buffer[64];
+        snprintf( buffer, sizeof(buffer), "%.3f", value );
+        m_Current += std::string(", \"") + key + "\": " + buffer;
+    }
+
+    void AddPercentiles( const char* prefix, std::vector< double >& samples )
+    {
+        std::string p( prefix );
+        Add( ( p + "_p50" ).c_str(),  Percentile( samples, 50.0 ) );
+        Add( ( p + "_p90" ).c_str(),  Percentile( samples, 90.0 ) );
+        Add( ( p + "_p99" ).c_str(),  Percentile( samples, 99.0 ) );
+        Add( ( p + "_p999" ).c_str(), Percentile( samples, 99.9 ) );
+        Add( ( p + "_max" ).c_str(),  samples.empty() ? 0.0 : *std::max_element( samples.begin(), samples.end() ) );
+    }
+
+    void End()
+    {
+        m_Results.push_back( m_Current + " }" );
+        fprintf( stderr, "%s\n", m_Results.back().c_str() );
+    }
+
+    void Write( FILE* out ) const
+    {
+        fprintf( out, "{\n  \"version\": 1,\n  \"benchmarks\": [\n" );
+        for ( size_t i = 0; i < m_Results.size(); ++i ) {
+            fprintf( out, "    %s%s\n", m_Results[i].c_str(), i + 1 < m_Results.size() ? "," : "" );
+        }
+        fprintf( out, "  ]\n}\n" );
+    }
+};
+
+static bool WaitFor( const boost::atomic<size_t>& counter, size_t count, int timeoutMs )
+{
+    boost::int64_t end = NowNs() + (boost::int64_t)timeoutMs * 1000000;
+    while ( counter.load() < count ) {
+        if ( NowNs() > end ) return false;
+        boost::this_thread::sleep( boost::posix_time::milliseconds(1) );
+    }
+    return true;
+}
+
+/* MessageQueueT Send/Wait throughput with 1..N producers */
+
+static void Produce( MessageQueue* queue, MessagePtr msg, size_t count )
+{
+    for ( size_t i = 0; i < count; ++i ) queue->Send( msg );
+}
+
+static void QueueThroughput( Report& report, size_t producers, size_t perProducer )
+{
+    MessageQueue queue;
+    MessagePtr msg( new StringMessage("bench.queue") );
+    size_t total = producers * perProducer;
+
+    boost::int64_t start = NowNs();
+    boost::thread_group threads;
+    for ( size_t i = 0; i < producers; ++i ) {
+        threads.create_thread( boost::bind( &Produce, &queue, msg, perProducer ) );
+    }
+    size_t received(0);
+    MessageQueue::ValueList batch;
+    while ( received < total ) {
+        if ( !queue.Wait() ) break;
+        ++received;
+        batch.clear();
+        received += queue.PollBatch( batch, Sequencer::MaxBatchSize );
+    }
+    boost::int64_t elapsed = NowNs() - start;
+    threads.join_all();
+
+    report.Begin( "queue_throughput" );
+    report.Add( "producers", (double)producers );
+    report.Add( "messages", (double)total );
+    report.Add( "msgs_per_sec", total / ( elapsed / 1e9 ) );
+    report.Add( "ns_per_msg", (double)elapsed / total );
+    report.End();
+}
+
+/* SeqTimedEffect expiry to Listener::OnEvent latency */
+
+class StampMessage : public Message
+{
+public:
+    boost::atomic< boost::int64_t > m_Sent;
+
+    StampMessage( MessageKey key ) : Message( key, Type() ), m_Sent(0) {}
+
+    static MessageKey Type()
+    {
+        static const MessageKey type = MessageSymbols::Intern("StampMessage");
+        return type;
+    }
+};
+
+// sends a new StampMessage each time, the listener may still be reading the previous one
+class StampEffect : public SeqTimedEffect
+{
+public:
+    StampEffect( double t, MessageKey key, int repeat ) : SeqTimedEffect( t, MessagePtr( new StampMessage(key) ), repeat ) {}
+protected:
+    virtual void OnNotify()
+    {
+        StampMessage* stamp = new StampMessage( m_Message->GetKey() );
+        MessagePtr msg( stamp );
+        stamp->m_Sent.store( NowNs() );
+        Send( msg );
+    }
+};
+
+class LatencyListener : public Listener
+{
+    MessageKey m_Key;
+public:
+    std::vector< double >  m_Samples;
+    boost::atomic<size_t>  m_Count;
+
+    LatencyListener( MessageKey key, size_t expected ) : m_Key(key), m_Count(0) { m_Samples.reserve( expected ); }
+
+    virtual bool GetEventKey( MessageKey& key ) const { key = m_Key; return true; }
+
+    virtual bool OnEvent( const MessagePtr& msg )
+    {
+        StampMessage* stamp = msg->Cast<StampMessage>();
+        if ( !stamp ) return false;
+        m_Samples.push_back( ( NowNs() - stamp->m_Sent.load() ) / 1000.0 );
+        m_Count.fetch_add(1);
+        return true;
+    }
+};
+
+static void DispatchLatency( Report& report, int repeats )
+{
+    MessageKey key = MessageSymbols::Intern("bench.latency");
+    boost::shared_ptr< LatencyListener > listener( new LatencyListener( key, repeats ) );
+    {
+        Sequencer sequencer;
+        sequencer.RegisterListener( listener );
+        sequencer.Add( SeqEffectPtr( new StampEffect( 1, key, repeats ) ) );
+        sequencer.Start();
+        WaitFor( listener->m_Count, repeats, repeats * 10 + 1000 );
+        sequencer.Stop();
+        // the message thread is joined here, it may still be in OnEvent after a timeout
+    }
+
+    report.Begin( "timer_to_listener_latency_us" );
+    report.Add( "samples", (double)listener->m_Samples.size() );
+    report.AddPercentiles( "latency_us", listener->m_Samples );
+    report.End();
+}
+
+/* listener fan-out cost */
+
+class CountingListener : public Listener
+{
+public:
+    boost::atomic<size_t>* m_Count;
+    MessageKey             m_Key;
+    bool                   m_Keyed;
+
+    CountingListener( boost::atomic<size_t>* count, MessageKey key, bool keyed ) : m_Count(count), m_Key(key), m_Keyed(keyed) {}
+
+    virtual bool GetEventKey( MessageKey& key ) const { key = m_Key; return m_Keyed; }
+
+    virtual bool OnEvent( const MessagePtr& msg )
+    {
+        if ( msg->GetKey() != m_Key ) return false;
+        m_Count->fetch_add( 1, boost::memory_order_relaxed );
+        return true;
+    }
+};
+
+static void ListenerFanOut( Report& report, size_t listeners, bool keyed, size_t messages )
+{
+    // outlives the sequencer, its listeners count into it
+    boost::atomic<size_t> count(0);
+    Sequencer sequencer;
+    sequencer.Start();
+
+    std::vector< std::string > names;
+    for ( size_t i = 0; i < listeners; ++i ) {
+        names.push_back( "bench.fanout." + boost::lexical_cast< std::string >( i ) );
+        sequencer.RegisterListener( ListenerPtr( new CountingListener( &count, MessageSymbols::Intern( names.back() ), keyed ) ) );
+    }
+    // one message per send, allocated up front
+    std::vector< MessagePtr > msgs;
+    msgs.reserve( messages );
+    for ( size_t i = 0; i < messages; ++i ) {
+        msgs.push_back( MessagePtr( new StringMessage( names[ i % listeners ].c_str() ) ) );
+    }
+
+    MessageQueuePtr queue = sequencer.GetMessageQueue();
+    boost::int64_t start = NowNs();
+    for ( size_t i = 0; i < messages; ++i ) {
+        queue->Send( msgs[i] );
+    }
+    WaitFor( count, messages, 60000 );
+    boost::int64_t elapsed = NowNs() - start;
+
+    report.Begin( keyed ? "listener_fanout_keyed" : "listener_fanout_wildcard" );
+    report.Add( "listeners", (double)listeners );
+    report.Add( "messages", (double)messages );
+    report.Add( "ns_per_msg", (double)elapsed / messages );
+    report.End();
+}
+
+/* timer lateness */
+
+class JitterEffect : public SeqTimedEffect
+{
+    boost::int64_t         m_Expected;
+    double*                m_Lateness;
+    boost::atomic<size_t>* m_Done;
+public:
+    JitterEffect( double t, const MessagePtr& msg, double* lateness, boost::atomic<size_t>* done )
+        : SeqTimedEffect( t, msg ), m_Expected(0), m_Lateness(lateness), m_Done(done) {}
+
+    bool Start()
+    {
+        m_Expected = NowNs() + (boost::int64_t)( m_Time * 1000000.0 );
+        return SeqTimedEffect::Start();
+    }
+protected:
+    virtual void OnNotify()
+    {
+        *m_Lateness = ( NowNs() - m_Expected ) / 1000.0;
+        m_Done->fetch_add(1);
+    }
+};
+
+static void TimerLateness( Report& report, size_t effects, double spreadMs )
+{
+    boost::atomic<size_t> done(0);
+    std::vector< double > lateness( effects, 0.0 );
+    {
+        Sequencer sequencer;
+        MessagePtr msg( new StringMessage("bench.timer") );
+        for ( size_t i = 0; i < effects; ++i ) {
+            double t = 1.0 + spreadMs * ( rand() / (double)RAND_MAX );
+            sequencer.Add( SeqEffectPtr( new JitterEffect( t, msg, &lateness[i], &done ) ) );
+        }
+        sequencer.Start();
+        WaitFor( done, effects, (int)spreadMs + 30000 );
+        sequencer.Stop();
+    }
+    lateness.resize( std::min( lateness.size(), done.load() ) );
+
+    report.Begin( "timer_lateness_us" );
+    report.Add( "effects", (double)effects );
+    report.Add( "fired", (double)done.load() );
+    report.AddPercentiles( "lateness_us", lateness );
+    report.End();
+}
+
+/* TimedEffectTable: bulk operations on many rows, then every row firing once */
+
+static double ElapsedMs( boost::int64_t start )
+{
+    return ( NowNs() - start ) / 1e6;
+}
+
+static void EffectTable( Report& report, size_t rows, double spreadMs )
+{
+    Sequencer sequencer;
+    boost::atomic<size_t> count(0);
+    MessagePtr msg( new StringMessage("bench.table") );
+    sequencer.RegisterListener( ListenerPtr( new CountingListener( &count, msg->GetKey(), true ) ) );
+    TimedEffectTablePtr table( new TimedEffectTable );
+    boost::uint32_t id = table->AddMessage( msg );
+
+    boost::int64_t start = NowNs();
+    table->Reserve( rows );
+    for ( size_t i = 0; i < rows; ++i ) table->Add( 1.0 + spreadMs * i / rows, id );
+    double addMs = ElapsedMs( start );
+    sequencer.Add( table );
+
+    start = NowNs();
+    table->Start( 0, rows );
+    double startMs = ElapsedMs( start );
+    start = NowNs();
+    table->Rearm( 0, rows );
+    double rearmMs = ElapsedMs( start );
+    start = NowNs();
+    table->Stop( 0, rows );
+    double stopMs = ElapsedMs( start );
+
+    sequencer.Start();
+    WaitFor( count, rows, (int)spreadMs + 60000 );
+    sequencer.Stop();
+    TimedEffectTable::LatenessStats late = table->GetLateness();
+
+    report.Begin( "effect_table" );
+    report.Add( "rows", (double)rows );
+    report.Add( "add_ns_per_row", addMs * 1e6 / rows );
+    report.Add( "start_ms", startMs );
+    report.Add( "rearm_ms", rearmMs );
+    report.Add( "stop_ms", stopMs );
+    report.Add( "fired", (double)count.load() );
+    report.Add( "lateness_us_mean", late.m_Count ? (double)late.m_Total / late.m_Count : 0.0 );
+    report.Add( "lateness_us_max", (double)late.m_Max );
+    report.End();
+}
+
+int main( int argc, char* argv[] )
+{
+    Report report;
+
+    size_t cores = std::max( 1u, boost::thread::hardware_concurrency() );
+    for ( size_t producers = 1; producers <= std::min( (size_t)8, cores * 2 ); producers *= 2 ) {
+        QueueThroughput( report, producers, 1000000 / producers );
+    }
+
+    DispatchLatency( report, 1000 );
+
+    size_t fanout[] = { 1, 10, 100, 1000 };
+    for ( size_t i = 0; i < sizeof(fanout) / sizeof(fanout[0]); ++i ) {
+        ListenerFanOut( report, fanout[i], false, 100000 );
+        ListenerFanOut( report, fanout[i], true, 100000 );
+    }
+
+    TimerLateness( report, 10, 500 );
+    TimerLateness( report, 1000, 500 );
+    TimerLateness( report, 100000, 1000 );
+
+    EffectTable( report, 1000, 500 );
+    EffectTable( report, 1000000, 1000 );
+
+    FILE* out = argc > 1 ? fopen( argv[1], "w" ) : stdout;
+    if ( !out ) {
+        fprintf( stderr, "can't open %s\n", argv[1] );
+        return EXIT_FAILURE;
+    }
+    report.Write( out );
+    if ( out != stdout ) fclose( out );
+
+    return EXIT_SUCCESS;
+}
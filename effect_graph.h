@@ -0,0 +1,315 @@
+#ifndef __EFFECT_GRAPH_H__
+#define __EFFECT_GRAPH_H__
+
+#include "message_queue.h"
+#include "sequence_effect.h"
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/unordered_map.hpp>
+
+/* Thread pool with a task deque per worker. A task submitted from a worker goes to that
+ * worker's own deque and is taken newest first, so a chain of tasks stays on one core;
+ * idle workers steal the oldest task of another worker. Submissions from outside the pool
+ * are spread round robin.
+ */
+class WorkStealingPool
+{
+public:
+    typedef boost::function< void () > Task;
+
+private:
+    struct Worker
+    {
+        boost::mutex      m_Lock;
+        std::deque< Task > m_Tasks;
+    };
+    typedef boost::shared_ptr< Worker > WorkerPtr;
+
+    std::vector< WorkerPtr >          m_Workers;
+    boost::thread_group               m_Threads;
+    // index of the calling worker, not set on other threads
+    boost::thread_specific_ptr<size_t> m_Self;
+    boost::atomic<size_t>             m_Next;
+    // tasks submitted and not taken yet
+    boost::atomic<size_t>             m_Queued;
+    boost::atomic<unsigned>           m_Sleeping;
+    boost::mutex                      m_IdleLock;
+    boost::condition_variable         m_Idle;
+    bool                              m_Stop;
+
+    WorkStealingPool( const WorkStealingPool& );
+    WorkStealingPool& operator=( const WorkStealingPool& );
+
+    bool Take( size_t self, Task& task )
+    {
+        {
+            Worker& own = *m_Workers[self];
+            boost::mutex::scoped_lock lock(own.m_Lock);
+            if ( !own.m_Tasks.empty() ) {
+                task.swap( own.m_Tasks.back() );
+                own.m_Tasks.pop_back();
+                return true;
+            }
+        }
+        for ( size_t i = 1; i < m_Workers.size(); ++i ) {
+            Worker& victim = *m_Workers[ ( self + i ) % m_Workers.size() ];
+            boost::mutex::scoped_lock lock(victim.m_Lock);
+            if ( !victim.m_Tasks.empty() ) {
+                task.swap( victim.m_Tasks.front() );
+                victim.m_Tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void WorkerThread( size_t self )
+    {
+        m_Self.reset( new size_t(self) );
+        Task task;
+        for (;;) {
+            if ( Take( self, task ) ) {
+                m_Queued.fetch_sub( 1, boost::memory_order_relaxed );
+                task();
+                task.clear();
+                continue;
+            }
+            boost::mutex::scoped_lock lock(m_IdleLock);
+            m_Sleeping.fetch_add( 1 );
+            while ( !m_Stop && m_Queued.load() == 0 ) m_Idle.wait( lock );
+            m_Sleeping.fetch_sub( 1, boost::memory_order_relaxed );
+            if ( m_Stop && m_Queued.load() == 0 ) return;
+        }
+    }
+
+public:
+    // threads == 0: one per core
+    WorkStealingPool( size_t threads = 0 )
+        : m_Next(0)
+        , m_Queued(0)
+        , m_Sleeping(0)
+        , m_Stop(false)
+    {
+        if ( threads == 0 ) threads = std::max( 1u, boost::thread::hardware_concurrency() );
+        for ( size_t i = 0; i < threads; ++i ) m_Workers.push_back( WorkerPtr( new Worker ) );
+        for ( size_t i = 0; i < threads; ++i ) {
+            m_Threads.create_thread( boost::bind( &WorkStealingPool::WorkerThread, this, i ) );
+        }
+    }
+
+    ~WorkStealingPool()
+    {
+        Stop();
+    }
+
+    void Submit( const Task& task )
+    {
+        size_t* self = m_Self.get();
+        Worker& worker = *m_Workers[ self ? *self : m_Next.fetch_add( 1, boost::memory_order_relaxed ) % m_Workers.size() ];
+        {
+            boost::mutex::scoped_lock lock(worker.m_Lock);
+            worker.m_Tasks.push_back( task );
+        }
+        m_Queued.fetch_add( 1 );
+        if ( m_Sleeping.load() ) {
+            // taking the lock orders us after a worker's last check before it sleeps
+            m_IdleLock.lock();
+            m_IdleLock.unlock();
+            m_Idle.notify_one();
+        }
+    }
+
+    size_t GetThreadCount() const
+    {
+        return m_Workers.size();
+    }
+
+    // runs what is queued, then joins the workers
+    void Stop()
+    {
+        {
+            boost::mutex::scoped_lock lock(m_IdleLock);
+            m_Stop = true;
+            m_Idle.notify_all();
+        }
+        m_Threads.join_all();
+    }
+};
+
+/* Dependency graph of the event triggered effects (SeqEffect::GetTriggerKey()), built
+ * when the sequencer starts. An effect depends on every effect whose output key is its
+ * trigger key. A dispatched message fires the effects it triggers as tasks on a
+ * WorkStealingPool, and a fired effect fires its dependents right away, without going
+ * round the message queue. Independent branches run in parallel, an effect runs after
+ * the effect that triggered it, and one effect never runs twice at the same time (each
+ * trigger fires it once). Messages the effects send still go through the queue to the
+ * listeners; those messages don't trigger graph effects again.
+ */
+class EffectGraph
+{
+    struct Node
+    {
+        SeqEffectPtr            m_Effect;
+        std::vector< Node* >    m_Next;
+        // triggers not handled yet, the first one schedules the node
+        boost::atomic<unsigned> m_Triggers;
+
+        Node( const SeqEffectPtr& effect ) : m_Effect(effect), m_Triggers(0) {}
+    };
+    typedef boost::shared_ptr< Node > NodePtr;
+    typedef boost::unordered_map< MessageKey, std::vector< Node* > > TriggerMap;
+    typedef boost::function< void () > IdleHandler;
+
+    WorkStealingPool          m_Pool;
+    std::vector< NodePtr >    m_Nodes;
+    TriggerMap                m_ByTrigger;
+    // per source id - 1: is the effect a node, i.e. its dependents fire directly
+    std::vector< bool >       m_IsNode;
+    size_t                    m_Edges;
+    boost::atomic<bool>       m_Active;
+    // node tasks submitted and not finished
+    boost::atomic<size_t>     m_InFlight;
+    // signaled when m_InFlight drops to 0, see also CallWhenIdle()
+    boost::mutex              m_IdleLock;
+    boost::condition_variable m_Idle;
+    IdleHandler               m_WhenIdle;
+
+    EffectGraph( const EffectGraph& );
+    EffectGraph& operator=( const EffectGraph& );
+
+    void Schedule( Node* node )
+    {
+        if ( node->m_Triggers.fetch_add( 1 ) != 0 ) return;
+        m_InFlight.fetch_add( 1 );
+        m_Pool.Submit( boost::bind( &EffectGraph::Run, this, node ) );
+    }
+
+    void Run( Node* node )
+    {
+        do {
+            if ( m_Active.load( boost::memory_order_acquire ) ) {
+                node->m_Effect->Trigger();
+                std::for_each( node->m_Next.begin(), node->m_Next.end(), boost::bind( &EffectGraph::Schedule, this, _1 ) );
+            }
+        } while ( node->m_Triggers.fetch_sub( 1 ) != 1 );
+        if ( m_InFlight.fetch_sub( 1, boost::memory_order_acq_rel ) == 1 ) {
+            boost::mutex::scoped_lock lock(m_IdleLock);
+            RunWhenIdle();
+            m_Idle.notify_all();
+        }
+    }
+
+    // under m_IdleLock, so Deactivate() returns only after the handler did
+    void RunWhenIdle()
+    {
+        if ( !m_WhenIdle ) return;
+        IdleHandler handler;
+        handler.swap( m_WhenIdle );
+        handler();
+    }
+
+public:
+    // threads == 0: one per core
+    EffectGraph( size_t threads = 0 )
+        : m_Pool(threads)
+        , m_Edges(0)
+        , m_Active(false)
+        , m_InFlight(0)
+    {}
+
+    ~EffectGraph()
+    {
+        Deactivate();
+    }
+
+    // message thread; effects[i] has source id i + 1, see Sequencer::Add()
+    void Build( const std::vector< SeqEffectPtr >& effects )
+    {
+        // running tasks hold pointers to the old nodes
+        Deactivate();
+        m_Nodes.clear();
+        m_ByTrigger.clear();
+        m_Edges = 0;
+        m_IsNode.assign( effects.size(), false );
+        MessageKey key;
+        for ( size_t i = 0; i < effects.size(); ++i ) {
+            if ( !effects[i]->GetTriggerKey( key ) ) continue;
+            NodePtr node( new Node( effects[i] ) );
+            m_Nodes.push_back( node );
+            m_ByTrigger[key].push_back( node.get() );
+            m_IsNode[i] = true;
+            effects[i]->SetGraphDriven( true );
+        }
+        for ( size_t n = 0; n < m_Nodes.size(); ++n ) {
+            TriggerMap::const_iterator it;
+            if ( !m_Nodes[n]->m_Effect->GetOutputKey( key ) || ( it = m_ByTrigger.find( key ) ) == m_ByTrigger.end() ) continue;
+            m_Nodes[n]->m_Next = it->second;
+            m_Edges += it->second.size();
+        }
+        m_Active.store( true, boost::memory_order_release );
+    }
+
+    // message thread; fires the effects msg triggers, unless they already ran from its sender
+    void Dispatch( const MessagePtr& msg, boost::uint32_t source )
+    {
+        if ( source && source <= m_IsNode.size() && m_IsNode[ source - 1 ] ) return;
+        TriggerMap::const_iterator it = m_ByTrigger.find( msg->GetKey() );
+        if ( it == m_ByTrigger.end() ) return;
+        std::for_each( it->second.begin(), it->second.end(), boost::bind( &EffectGraph::Schedule, this, _1 ) );
+    }
+
+    // stops firing and waits for running effects, the effects go back to their listeners
+    void Deactivate()
+    {
+        m_Active.store( false, boost::memory_order_release );
+        {
+            boost::mutex::scoped_lock lock(m_IdleLock);
+            while ( m_InFlight.load( boost::memory_order_acquire ) ) m_Idle.wait( lock );
+            RunWhenIdle();
+        }
+        for ( size_t i = 0; i < m_Nodes.size(); ++i ) m_Nodes[i]->m_Effect->SetGraphDriven( false );
+    }
+
+    // no effect running or scheduled; what they sent is in the queue by then
+    bool IsIdle() const
+    {
+        return m_InFlight.load( boost::memory_order_acquire ) == 0;
+    }
+
+    /* True if idle. Otherwise handler runs once, on the worker that finishes the last task
+     * (or in Deactivate()); it must not call back into the graph. Replaces an earlier handler.
+     */
+    bool CallWhenIdle( const IdleHandler& handler )
+    {
+        boost::mutex::scoped_lock lock(m_IdleLock);
+        if ( m_InFlight.load( boost::memory_order_acquire ) == 0 ) return true;
+        m_WhenIdle = handler;
+        return false;
+    }
+
+    size_t GetNodeCount() const
+    {
+        return m_Nodes.size();
+    }
+
+    size_t GetEdgeCount() const
+    {
+        return m_Edges;
+    }
+
+    size_t GetThreadCount() const
+    {
+        return m_Pool.GetThreadCount();
+    }
+};
+
+#endif /* __EFFECT_GRAPH_H__ */
@@ -0,0 +1,413 @@
+#ifndef __EFFECT_TABLE_H__
+#define __EFFECT_TABLE_H__
+
+#include "message_queue.h"
+#include "listener.h"
+#include "sequence_effect.h"
+#include "sequencer.h"
+#include "sequence_timed_effect.h"
+#include "timing_wheel.h"
+
+#include <vector>
+#include <algorithm>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/integer_traits.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+/* Many timed effects in one, stored column wise: deadlines, periods, repeat counters and
+ * message ids each in a contiguous array, the messages themselves once in a message
+ * table. The table is a single SeqEffect with a single timing wheel entry for its
+ * earliest deadline; when that fires one pass over the deadlines fires every due row and
+ * finds the next deadline. Start()/Stop() and the range operations touch the arrays in
+ * bulk, there are no per row objects, timers or virtual calls. A row behaves like a
+ * SeqTimedEffect with CATCHUP_FIRE_ALL; effects which need more stay SeqEffects of their own.
+ *
+ *     TimedEffectTablePtr table( new TimedEffectTable );
+ *     boost::uint32_t tick = table->AddMessage( MessagePtr( new StringMessage("tick") ) );
+ *     for ( int i = 0; i < 1000000; ++i ) table->Add( 10 + i % 100, tick, -1 );
+ *     seq.Add( table );
+ */
+class TimedEffectTable : public SeqEffect
+{
+public:
+    typedef size_t Row;
+    // over all rows; m_Missed stays 0, rows fire every missed period
+    typedef SeqTimedEffect::LatenessStats LatenessStats;
+
+    // rows scanned per block, a block without due rows costs a compare per row
+    enum { ScanBlock = 64 };
+
+    // deadline of a stopped row
+    static boost::int64_t Never()
+    {
+        return boost::integer_traits< boost::int64_t >::const_max;
+    }
+
+    // returned by Add() for a message id not from AddMessage()
+    static Row InvalidRow()
+    {
+        return Row(-1);
+    }
+
+private:
+    // columns, indexed by row
+    std::vector< boost::int64_t >  m_Deadline;  // Sequencer::GetTime() microseconds
+    std::vector< boost::int64_t >  m_Period;    // microseconds
+    std::vector< boost::int32_t >  m_Repeat;    // as given to Add()
+    std::vector< boost::int32_t >  m_Remaining; // fires left, < 0 forever
+    std::vector< boost::uint32_t > m_MessageId;
+    std::vector< MessagePtr >      m_Messages;
+
+    Sequencer*                     m_Sequencer;
+    TimingWheel::Entry             m_Entry;
+    // the arrays; the timer only try-locks it, it runs under the wheel's lock
+    mutable boost::mutex           m_Lock;
+
+    // lateness of the rows' firings in microseconds, written on the service thread only
+    boost::atomic< boost::int64_t > m_LateCount;
+    boost::atomic< boost::int64_t > m_LateTotal;
+    boost::atomic< boost::int64_t > m_LateMax;
+    boost::atomic< boost::int64_t > m_LateLast;
+
+    TimedEffectTable( const TimedEffectTable& );
+    TimedEffectTable& operator=( const TimedEffectTable& );
+
+    // table locked
+    void Schedule( boost::int64_t earliest )
+    {
+        if ( !m_Sequencer ) return;
+        if ( earliest == Never() ) {
+            m_Entry.Cancel();
+        } else {
+            m_Sequencer->ScheduleAt( m_Entry, earliest );
+        }
+    }
+
+    // table locked
+    boost::int64_t Earliest( Row first, Row end ) const
+    {
+        boost::int64_t earliest = Never();
+        const boost::int64_t* deadline = m_Deadline.empty() ? NULL : &m_Deadline[0];
+        for ( Row i = first; i < end; ++i ) earliest = std::min( earliest, deadline[i] );
+        return earliest;
+    }
+
+    // returns how late the row fires
+    boost::int64_t Fire( Row row, boost::int64_t now )
+    {
+        boost::int64_t late = now - m_Deadline[row];
+        Send( m_Messages[ m_MessageId[row] ] );
+        boost::int32_t& remaining = m_Remaining[row];
+        if ( remaining == 1 ) {
+            remaining = 0;
+            m_Deadline[row] = Never();
+        } else {
+            if ( remaining > 1 ) --remaining;
+            m_Deadline[row] += m_Period[row];
+        }
+        return late;
+    }
+
+    // service thread, under the wheel's lock
+    void OnTimer()
+    {
+        boost::mutex::scoped_try_lock lock(m_Lock);
+        if ( !lock.owns_lock() ) {
+            // a bulk operation is on, it reschedules when done; look again next tick
+            m_Sequencer->ScheduleAt( m_Entry, m_Sequencer->GetTime() );
+            return;
+        }
+        boost::int64_t now = m_Sequencer->GetTime();
+        const Row rows = m_Deadline.size();
+        const boost::int64_t* deadline = rows ? &m_Deadline[0] : NULL;
+        boost::int64_t earliest = Never();
+        boost::uint64_t fired(0);
+        boost::int64_t lateTotal(0), lateMax(0), late(0);
+        for ( Row base = 0; base < rows; base += ScanBlock ) {
+            Row end = std::min( rows, base + (Row)ScanBlock );
+            // branch free, so the compiler can vectorize the scan (-O3, on x86 with SSE4.2 and up)
+            unsigned due(0);
+            boost::int64_t blockEarliest = Never();
+            for ( Row i = base; i < end; ++i ) {
+                due += deadline[i] <= now;
+                blockEarliest = std::min( blockEarliest, deadline[i] );
+            }
+            if ( due ) {
+                for ( Row i = base; i < end; ++i ) {
+                    if ( deadline[i] > now ) continue;
+                    late = Fire( i, now );
+                    lateTotal += late;
+                    lateMax = std::max( lateMax, late );
+                    m_Sequencer->RecordTimerLateness( late );
+                }
+                fired += due;
+                blockEarliest = Earliest( base, end );
+            }
+            earliest = std::min( earliest, blockEarliest );
+        }
+        m_NotifyCount.fetch_add( fired, boost::memory_order_relaxed );
+        if ( fired ) {
+            m_LateCount.fetch_add( fired, boost::memory_order_relaxed );
+            m_LateTotal.fetch_add( lateTotal, boost::memory_order_relaxed );
+            m_LateLast.store( late, boost::memory_order_relaxed );
+            if ( lateMax > m_LateMax.load( boost::memory_order_relaxed ) ) m_LateMax.store( lateMax, boost::memory_order_relaxed );
+        }
+        Schedule( earliest );
+    }
+
+    // table locked; (re)starts rows of [first, end) at now, resets their repeats if restart
+    void Arm( Row first, Row end, bool restart )
+    {
+        boost::int64_t now = m_Sequencer ? m_Sequencer->GetTime() : 0;
+        for ( Row i = first; i < end; ++i ) {
+            if ( restart ) m_Remaining[i] = m_Repeat[i] > 0 ? m_Repeat[i] : ( m_Repeat[i] < 0 ? -1 : 1 );
+            m_Deadline[i] = m_Remaining[i] ? now + m_Period[i] : Never();
+        }
+    }
+
+public:
+    TimedEffectTable( const MessageQueuePtr& msgQueue = MessageQueuePtr() )
+        : SeqEffect(msgQueue)
+        , m_Sequencer(NULL)
+        , m_LateCount(0)
+        , m_LateTotal(0)
+        , m_LateMax(0)
+        , m_LateLast(0)
+    {
+    }
+
+    virtual ~TimedEffectTable()
+    {
+        Stop();
+    }
+
+    virtual void Init( Sequencer *sequencer )
+    {
+        if ( sequencer ) {
+            m_Sequencer = sequencer;
+            m_Entry.SetCallback( boost::bind( &TimedEffectTable::OnTimer, this ) );
+        }
+    }
+
+    void Reserve( size_t rows )
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        m_Deadline.reserve( rows );
+        m_Period.reserve( rows );
+        m_Repeat.reserve( rows );
+        m_Remaining.reserve( rows );
+        m_MessageId.reserve( rows );
+    }
+
+    // returns the message id for Add(); a message may be shared by any number of rows
+    boost::uint32_t AddMessage( const MessagePtr& msg )
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        m_Messages.push_back( msg );
+        return (boost::uint32_t)( m_Messages.size() - 1 );
+    }
+
+    /* A row firing every ms milliseconds, repeat times (0 and 1: once, < 0: until
+     * stopped). It starts with the table, or with Start( row, 1 ) if added later.
+     * InvalidRow() if messageId is unknown.
+     */
+    Row Add( double ms, boost::uint32_t messageId, int repeat = 0 )
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        if ( messageId >= m_Messages.size() ) return InvalidRow();
+        m_Deadline.push_back( Never() );
+        m_Period.push_back( (boost::int64_t)( ms * 1000.0 + 0.5 ) );
+        m_Repeat.push_back( repeat );
+        m_Remaining.push_back( 0 );
+        m_MessageId.push_back( messageId );
+        return m_Deadline.size() - 1;
+    }
+
+    // all rows
+    virtual bool Start()
+    {
+        return Start( 0, size_t(-1) );
+    }
+
+    virtual void Stop()
+    {
+        Stop( 0, size_t(-1) );
+    }
+
+    // starts count rows from first afresh, with their full repeat count
+    bool Start( Row first, size_t count )
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        Row end = std::min( first + std::min( count, m_Deadline.size() ), m_Deadline.size() );
+        first = std::min( first, end );
+        Arm( first, end, true );
+        Schedule( Earliest( 0, m_Deadline.size() ) );
+        return false;
+    }
+
+    // re-arms running rows among count rows from first one period from now, repeats left stay
+    void Rearm( Row first, size_t count )
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        Row end = std::min( first + std::min( count, m_Deadline.size() ), m_Deadline.size() );
+        first = std::min( first, end );
+        Arm( first, end, false );
+        Schedule( Earliest( 0, m_Deadline.size() ) );
+    }
+
+    void Stop( Row first, size_t count )
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        Row end = std::min( first + std::min( count, m_Deadline.size() ), m_Deadline.size() );
+        first = std::min( first, end );
+        std::fill( m_Deadline.begin() + first, m_Deadline.begin() + end, Never() );
+        std::fill( m_Remaining.begin() + first, m_Remaining.begin() + end, 0 );
+        Schedule( Earliest( 0, m_Deadline.size() ) );
+    }
+
+    size_t GetRowCount() const
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        return m_Deadline.size();
+    }
+
+    // Never() once the row is stopped or done
+    boost::int64_t GetDeadline( Row row ) const
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        return m_Deadline[row];
+    }
+
+    LatenessStats GetLateness() const
+    {
+        LatenessStats stats;
+        stats.m_Count  = m_LateCount.load( boost::memory_order_relaxed );
+        stats.m_Total  = m_LateTotal.load( boost::memory_order_relaxed );
+        stats.m_Max    = m_LateMax.load( boost::memory_order_relaxed );
+        stats.m_Last   = m_LateLast.load( boost::memory_order_relaxed );
+        stats.m_Missed = 0;
+        return stats;
+    }
+};
+typedef boost::shared_ptr< TimedEffectTable > TimedEffectTablePtr;
+
+/* Many event effects in one: rows of trigger key and message id, columns as in
+ * TimedEffectTable. One listener for the whole table looks up the rows of a message's key,
+ * a row sends its message whenever its trigger arrives while it is started.
+ */
+class EventEffectTable : public SeqEffect
+{
+public:
+    typedef size_t Row;
+
+    // returned by Add() for a message id not from AddMessage()
+    static Row InvalidRow()
+    {
+        return Row(-1);
+    }
+
+private:
+    typedef boost::unordered_map< MessageKey, std::vector< Row > > TriggerMap;
+
+    std::vector< MessageKey >      m_TriggerKey;
+    std::vector< boost::uint32_t > m_MessageId;
+    std::vector< boost::uint8_t >  m_Active;
+    std::vector< MessagePtr >      m_Messages;
+    TriggerMap                     m_ByTrigger;
+    // the arrays
+    mutable boost::mutex           m_Lock;
+
+    EventEffectTable( const EventEffectTable& );
+    EventEffectTable& operator=( const EventEffectTable& );
+
+    // message thread
+    bool OnEvent( const MessagePtr& msg )
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        TriggerMap::const_iterator it = m_ByTrigger.find( msg->GetKey() );
+        if ( it == m_ByTrigger.end() ) return false;
+        boost::uint64_t fired(0);
+        for ( std::vector< Row >::const_iterator row = it->second.begin(); row != it->second.end(); ++row ) {
+            if ( !m_Active[*row] ) continue;
+            Send( m_Messages[ m_MessageId[*row] ] );
+            ++fired;
+        }
+        m_NotifyCount.fetch_add( fired, boost::memory_order_relaxed );
+        return fired != 0;
+    }
+
+    void SetActive( Row first, size_t count, bool active )
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        Row end = std::min( first + std::min( count, m_Active.size() ), m_Active.size() );
+        first = std::min( first, end );
+        std::fill( m_Active.begin() + first, m_Active.begin() + end, active ? 1 : 0 );
+    }
+
+public:
+    EventEffectTable( const MessageQueuePtr& msgQueue = MessageQueuePtr() )
+        : SeqEffect(msgQueue)
+    {
+    }
+
+    virtual void Init( Sequencer *sequencer )
+    {
+        if ( sequencer ) {
+            GenericListener::OnMessageFunc onEvent( boost::bind( &EventEffectTable::OnEvent, this, _1 ) );
+            sequencer->RegisterListener( ListenerPtr( new GenericListener( onEvent ) ) );
+        }
+    }
+
+    boost::uint32_t AddMessage( const MessagePtr& msg )
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        m_Messages.push_back( msg );
+        return (boost::uint32_t)( m_Messages.size() - 1 );
+    }
+
+    // sends message messageId whenever a message with key trigger arrives; InvalidRow() if messageId is unknown
+    Row Add( MessageKey trigger, boost::uint32_t messageId )
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        if ( messageId >= m_Messages.size() ) return InvalidRow();
+        m_TriggerKey.push_back( trigger );
+        m_MessageId.push_back( messageId );
+        m_Active.push_back( 0 );
+        m_ByTrigger[trigger].push_back( m_TriggerKey.size() - 1 );
+        return m_TriggerKey.size() - 1;
+    }
+
+    virtual bool Start()
+    {
+        SetActive( 0, size_t(-1), true );
+        return true;
+    }
+
+    virtual void Stop()
+    {
+        SetActive( 0, size_t(-1), false );
+    }
+
+    void Start( Row first, size_t count )
+    {
+        SetActive( first, count, true );
+    }
+
+    void Stop( Row first, size_t count )
+    {
+        SetActive( first, count, false );
+    }
+
+    size_t GetRowCount() const
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        return m_TriggerKey.size();
+    }
+};
+typedef boost::shared_ptr< EventEffectTable > EventEffectTablePtr;
+
+#endif /* __EFFECT_TABLE_H__ */
@@ -29,6 +29,10 @@ public:
     virtual ~Listener() {}
 
     virtual bool OnEvent( const MessagePtr& msg ) { return false; }
+
+    // listeners interested in a single key return true; the sequencer then only calls
+    // OnEvent for messages with that key. The key must not change while registered.
+    virtual bool GetEventKey( MessageKey& key ) const { return false; }
 };
 
 class GenericListener : public Listener
@@ -53,17 +57,20 @@ protected:
     GenericEventListener();
 
 public:
-    GenericEventListener( const MessagePtr& mask , const OnMessageFunc& func ) : GenericListener(func), m_EventMask(mask) {}
+    GenericEventListener( const MessagePtr& mask , const OnMessageFunc& func ) : GenericListener(func), m_EventMask(mask), m_EventKey(mask->GetKey()) {}
 
     virtual ~GenericEventListener() {}
 
     const MessagePtr& GetEventMask() const { return m_EventMask; }
 
+    virtual bool GetEventKey( MessageKey& key ) const { key = m_EventKey; return true; }
+
     virtual bool OnEvent( const MessagePtr& msg ) {
-        return ( *msg == *m_EventMask ) ? m_OnMessageFunc( msg ) : false;
+        return ( msg->GetKey() == m_EventKey ) ? m_OnMessageFunc( msg ) : false;
     }
 protected:
     MessagePtr m_EventMask;
+    MessageKey m_EventKey;
 };
 
 class EventListener : public Listener
@@ -71,26 +78,36 @@ class EventListener : public Listener
     // use our own message queue
     MessageQueuePtr m_MessageQueue;
     MessagePtr      m_ListenEvent;
+    MessageKey      m_ListenKey;
 
     EventListener( const EventListener& );
 public:
-    EventListener() : m_MessageQueue( new MessageQueue )
+    EventListener() : m_MessageQueue( new MessageQueue ), m_ListenKey(0)
     {
     }
 
-    EventListener( const MessagePtr& evt ) : m_MessageQueue( new MessageQueue ), m_ListenEvent(evt)
+    EventListener( const MessagePtr& evt ) : m_MessageQueue( new MessageQueue ), m_ListenEvent(evt), m_ListenKey(evt->GetKey())
     {
     }
 
+    // call before registering with a sequencer, the listener is indexed by this key
     void SetEventToListen(const MessagePtr& evt)
     {
         m_ListenEvent = evt;
+        m_ListenKey   = evt->GetKey();
     }
 
     const MessagePtr& GetEventToListen() const
     {
         return m_ListenEvent;
     }
+
+    virtual bool GetEventKey( MessageKey& key ) const
+    {
+        if ( !m_ListenEvent ) return false;
+        key = m_ListenKey;
+        return true;
+    }
     // called from main thread
     void WaitEvent()
     {
@@ -98,8 +115,8 @@ public:
         do {
             // do not process message in mask - normally we would only list to TERMINATE here.
             MessagePtr evt = m_MessageQueue->Wait( );
-            while ( !terminate && evt != NULL ) {
-                terminate = ( *evt == *m_ListenEvent );
+            while ( !terminate && evt ) {
+                terminate = ( evt->GetKey() == m_ListenKey );
                 if ( !terminate) evt = m_MessageQueue->Poll( );
             }
         } while ( !terminate );
@@ -109,7 +126,7 @@ public:
     {
         MessagePtr evt = m_MessageQueue->Poll();
         if ( evt ) {
-            return ( *evt == *m_ListenEvent );
+            return ( evt->GetKey() == m_ListenKey );
         }
         return false;
     }
@@ -117,7 +134,7 @@ protected:
     // called from sequencer message thread
     virtual bool OnEvent( const MessagePtr& msg )
     {
-        if ( *msg == *m_ListenEvent ) { m_MessageQueue->Send( msg ); return true; }
+        if ( msg->GetKey() == m_ListenKey ) { m_MessageQueue->Send( msg ); return true; }
         return false;
     }
 
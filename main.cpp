@@ -22,15 +22,16 @@ class AppListener : public Listener
 {
     // use our own message queue
     MessageQueuePtr m_MessageQueue;
+    MessageKey      m_StopKey;
 public:
-    AppListener() : m_MessageQueue( new MessageQueue )
+    AppListener() : m_MessageQueue( new MessageQueue ), m_StopKey( Sequencer::StateMessage::StateKey( Sequencer::STOPPED ) )
     {
     }
 
     // called from sequencer message thread
     virtual bool OnEvent( const MessagePtr& msg )
     {
-        if ( msg->asString() == "STOPPED" ) { m_MessageQueue->Send( msg ); return true; }
+        if ( msg->GetKey() == m_StopKey ) { m_MessageQueue->Send( msg ); return true; }
         return false;
     }
 
@@ -41,8 +42,8 @@ public:
         do {
             // do not process message in mask - normally we would only list to TERMINATE here.
             MessagePtr evt = m_MessageQueue->Wait( );
-            while ( !terminate && evt != NULL ) {
-                terminate = ( evt->asString().compare( "STOPPED" ) == 0 );
+            while ( !terminate && evt ) {
+                terminate = ( evt->GetKey() == m_StopKey );
                 std::cout << "AppListener::Received Event: " << evt->asString() << std::endl;
                 if ( !terminate) evt = m_MessageQueue->Poll( );
             }
@@ -55,6 +56,9 @@ typedef boost::shared_ptr<AppListener> AppListenerPtr;
 
 int main( int argc, char* argv[] )
 {
+    // main --trace <file>: binary trace of everything the sequencer and its effects do, written in the background
+    if ( argc > 2 && std::string( argv[1] ) == "--trace" ) Tracer::Open( argv[2], Tracer::TRACE_ALL );
+
     // simple sequence- almost like a timed statemachine; does not have a state transition on its own, though
     Sequencer sequencer;
     // repeat 5 times every 200ms
@@ -64,7 +68,7 @@ int main( int argc, char* argv[] )
     // one shot @ 500ms.
     sequencer.Add( SeqEffectPtr( new SeqTimedEffect( 500, middle )));
     // exit after 1 second, we could also use a counter in "OneHundret" and send terminate from there. Add 10ms to avoid overlap with 1
-    sequencer.Add( SeqEffectPtr( new SeqTimedEffect( 1010, MessagePtr( new Sequencer::StateMessage( Sequencer::TERMINATE)) )));
+    sequencer.Add( SeqEffectPtr( new SeqTimedEffect( 1010, Sequencer::StateMessage::Get( Sequencer::TERMINATE ) )));
     // this one waits for an event, send from another effect (middle)
     sequencer.Add( SeqEffectPtr( new SeqEventEffect( middle,  MessagePtr( new StringMessage("Hey, we got a message! Creating a new one!")) )));
     // Start it
@@ -78,5 +82,7 @@ int main( int argc, char* argv[] )
 
     std::cout << "Application::Exit" << std::endl;
 
+    Tracer::Close();
+
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,157 @@
+#ifndef __MESSAGE_CODEC_H__
+#define __MESSAGE_CODEC_H__
+
+#include "message_queue.h"
+#include "value_message.h"
+#include "sequencer.h"
+
+#include <cstring>
+#include <string>
+
+#include <boost/cstdint.hpp>
+
+/* Compact binary form of a message, for passing messages between processes. Keys and
+ * payload types are interned per process, so they travel by name and are looked up again
+ * on the receiving side. Byte order is the host's, i.e. both ends run on the same machine.
+ * By default Decode() only accepts names the receiver already knows and no state
+ * messages, so an untrusted sender can neither grow the symbol table nor stop a sequencer.
+ *
+ *     WireHeader | key name | payload type name | payload
+ *
+ * Message, StringMessage, Sequencer::StateMessage, ValueMessage and BinaryMessage are
+ * supported; a BinaryMessage is copied into a new BinaryBuffer when decoded.
+ */
+class MessageCodec
+{
+public:
+    enum Kinds
+    {
+        KIND_MESSAGE = 1,
+        KIND_STRING  = 2,
+        KIND_STATE   = 3,   // payload: the state, one byte
+        KIND_VALUE   = 4,
+        KIND_BINARY  = 5
+    };
+
+    // see Decode()
+    enum DecodeFlags
+    {
+        DECODE_INTERN  = 1,     // interns unknown key and type names
+        DECODE_STATE   = 2,     // accepts Sequencer::StateMessages, e.g. TERMINATE
+        DECODE_TRUSTED = DECODE_INTERN | DECODE_STATE
+    };
+
+    struct WireHeader
+    {
+        boost::uint8_t  m_Kind;
+        boost::uint8_t  m_TypeSize;     // payload type name
+        boost::uint16_t m_KeySize;      // key name
+        boost::uint32_t m_PayloadSize;
+    };
+
+    static bool IsSupported( const Message& msg )
+    {
+        MessageKey type = msg.GetType();
+        return type == Message::Type() || type == StringMessage::Type() || type == Sequencer::StateMessage::Type()
+            || type == ValueMessage::Type() || type == BinaryMessage::Type();
+    }
+
+    /* Writes msg to out, returns the number of bytes written or 0 if the message type is
+     * not supported or it does not fit into capacity bytes.
+     */
+    static size_t Encode( const Message& msg, char* out, size_t capacity )
+    {
+        WireHeader header = { 0, 0, 0, 0 };
+        std::string type;
+        const void* payload(NULL);
+        boost::uint8_t state(0);
+
+        if ( msg.GetType() == Message::Type() ) {
+            header.m_Kind = KIND_MESSAGE;
+        } else if ( msg.Cast<StringMessage>() ) {
+            header.m_Kind = KIND_STRING;
+        } else if ( const Sequencer::StateMessage* sm = msg.Cast<Sequencer::StateMessage>() ) {
+            header.m_Kind        = KIND_STATE;
+            state                = (boost::uint8_t)sm->GetState();
+            payload              = &state;
+            header.m_PayloadSize = 1;
+        } else if ( const ValueMessage* vm = msg.Cast<ValueMessage>() ) {
+            header.m_Kind        = KIND_VALUE;
+            type                 = MessageSymbols::Name( vm->GetPayloadType() );
+            payload              = vm->GetData();
+            header.m_PayloadSize = (boost::uint32_t)vm->GetSize();
+        } else if ( const BinaryMessage* bm = msg.Cast<BinaryMessage>() ) {
+            header.m_Kind        = KIND_BINARY;
+            if ( bm->GetPayloadType() ) type = MessageSymbols::Name( bm->GetPayloadType() );
+            payload              = bm->GetData();
+            header.m_PayloadSize = (boost::uint32_t)bm->GetSize();
+        } else {
+            return 0;
+        }
+
+        std::string key = MessageSymbols::Name( msg.GetKey() );
+        if ( key.size() > 0xffff || type.size() > 0xff ) return 0;
+        header.m_KeySize  = (boost::uint16_t)key.size();
+        header.m_TypeSize = (boost::uint8_t)type.size();
+
+        size_t size = sizeof(header) + key.size() + type.size() + header.m_PayloadSize;
+        if ( size > capacity ) return 0;
+        std::memcpy( out, &header, sizeof(header) );
+        out += sizeof(header);
+        std::memcpy( out, key.data(), key.size() );
+        out += key.size();
+        std::memcpy( out, type.data(), type.size() );
+        out += type.size();
+        if ( header.m_PayloadSize ) std::memcpy( out, payload, header.m_PayloadSize );
+        return size;
+    }
+
+    // with DECODE_INTERN any name is accepted, else only names already interned
+    static bool LookupName( const std::string& name, unsigned flags, MessageKey& key )
+    {
+        if ( flags & DECODE_INTERN ) {
+            key = MessageSymbols::Intern( name );
+            return true;
+        }
+        return MessageSymbols::Find( name, key );
+    }
+
+    /* NULL if the data is not a valid encoding, or flags (DecodeFlags) refuse it: an
+     * unknown key or payload type name, a state message.
+     */
+    static MessagePtr Decode( const char* data, size_t size, unsigned flags = 0 )
+    {
+        WireHeader header;
+        if ( size < sizeof(header) ) return MessagePtr();
+        std::memcpy( &header, data, sizeof(header) );
+        if ( size != sizeof(header) + header.m_KeySize + header.m_TypeSize + header.m_PayloadSize ) return MessagePtr();
+
+        const char* p = data + sizeof(header);
+        std::string name( p, header.m_KeySize );
+        p += header.m_KeySize;
+        MessageKey key(0), type(0);
+        if ( !LookupName( name, flags, key ) ) return MessagePtr();
+        if ( header.m_TypeSize && !LookupName( std::string( p, header.m_TypeSize ), flags, type ) ) return MessagePtr();
+        p += header.m_TypeSize;
+
+        switch ( header.m_Kind ) {
+        case KIND_MESSAGE:
+            return MessagePtr( new Message( key, Message::Type() ) );
+        case KIND_STRING:
+            return MessagePtr( new StringMessage( name.c_str() ) );
+        case KIND_STATE:
+            if ( !( flags & DECODE_STATE ) || header.m_PayloadSize != 1 || (boost::uint8_t)*p > Sequencer::RESUME ) break;
+            return Sequencer::StateMessage::Get( (Sequencer::SeqStates)(boost::uint8_t)*p );
+        case KIND_VALUE:
+            if ( header.m_PayloadSize > ValueMessage::InlineSize ) break;
+            return MessagePtr( new ValueMessage( key, type, p, header.m_PayloadSize ) );
+        case KIND_BINARY:
+            return MessagePtr( new BinaryMessage( key, BinaryBuffer::Create( p, header.m_PayloadSize ), type ) );
+        default:
+            break;
+        }
+        return MessagePtr();
+    }
+};
+
+#endif /* __MESSAGE_CODEC_H__ */
@@ -0,0 +1,360 @@
+#ifndef __MESSAGE_LOG_H__
+#define __MESSAGE_LOG_H__
+
+#include "message_queue.h"
+#include "message_codec.h"
+#include "sequencer.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+/* Append-only message log. The file starts with a LogFileHeader followed by records, each
+ * a LogRecordHeader and the message's MessageCodec encoding, padded to 8 bytes. The file
+ * grows in chunks of zeros, a record size of 0 marks the end, so the log of a process that
+ * died is readable up to its last complete record.
+ */
+struct LogFileHeader
+{
+    char            m_Magic[8];     // "SEQMLOG"
+    boost::uint32_t m_Version;
+    boost::uint32_t m_HeaderSize;
+};
+
+struct LogRecordHeader
+{
+    boost::int64_t  m_Time;         // Sequencer::GetTime(), microseconds
+    boost::uint32_t m_Source;       // sending effect, see SeqEffect::GetSourceId()
+    boost::uint32_t m_Size;         // of the encoded message
+};
+
+class MessageLogWriter;
+typedef boost::shared_ptr< MessageLogWriter > MessageLogWriterPtr;
+
+/* Writes a log through a memory mapping. Append() is a memcpy into the mapping, the file
+ * is extended (and remapped) once per ChunkSize bytes. One writing thread. As a sequencer's
+ * recorder it logs every message the sequencer dispatches:
+ *
+ *     seq.SetRecorder( MessageLogWriter::Create( "session.log" ) );
+ */
+class MessageLogWriter : public Sequencer::Recorder
+{
+public:
+    enum { ChunkSize = 16 << 20, Version = 1 };
+
+private:
+    std::string                        m_Path;
+    boost::interprocess::mapped_region m_Region;
+    char*                              m_Data;
+    size_t                             m_Capacity;
+    size_t                             m_Used;
+    boost::atomic< boost::uint64_t >   m_Records;
+    boost::atomic< boost::uint64_t >   m_Skipped;
+
+    MessageLogWriter( const std::string& path )
+        : m_Path(path)
+        , m_Data(NULL)
+        , m_Capacity(0)
+        , m_Used(0)
+        , m_Records(0)
+        , m_Skipped(0)
+    {}
+
+    MessageLogWriter( const MessageLogWriter& );
+    MessageLogWriter& operator=( const MessageLogWriter& );
+
+    // extends the file with zeros to at least size and maps all of it
+    bool Grow( size_t size )
+    {
+        size_t capacity = ( ( size + ChunkSize - 1 ) / ChunkSize ) * ChunkSize;
+        {
+            boost::interprocess::mapped_region none;
+            m_Region.swap( none );
+        }
+        m_Data = NULL;
+        FILE* file = fopen( m_Path.c_str(), "r+b" );
+        if ( !file ) return false;
+        bool ok = fseek( file, (long)( capacity - 1 ), SEEK_SET ) == 0 && fputc( 0, file ) != EOF;
+        fclose( file );
+        if ( !ok ) return false;
+        try {
+            boost::interprocess::file_mapping mapping( m_Path.c_str(), boost::interprocess::read_write );
+            boost::interprocess::mapped_region region( mapping, boost::interprocess::read_write, 0, capacity );
+            m_Region.swap( region );
+        } catch ( const boost::interprocess::interprocess_exception& ) {
+            return false;
+        }
+        m_Data     = static_cast< char* >( m_Region.get_address() );
+        m_Capacity = capacity;
+        return true;
+    }
+
+public:
+    // truncates an existing log; an empty pointer if the file can't be written
+    static MessageLogWriterPtr Create( const std::string& path )
+    {
+        FILE* file = fopen( path.c_str(), "wb" );
+        if ( !file ) return MessageLogWriterPtr();
+        fclose( file );
+
+        MessageLogWriterPtr log( new MessageLogWriter( path ) );
+        if ( !log->Grow( ChunkSize ) ) return MessageLogWriterPtr();
+        LogFileHeader header = { { 'S','E','Q','M','L','O','G',0 }, Version, sizeof(LogFileHeader) };
+        std::memcpy( log->m_Data, &header, sizeof(header) );
+        log->m_Used = sizeof(header);
+        return log;
+    }
+
+    virtual ~MessageLogWriter()
+    {
+        Close();
+    }
+
+    // message thread
+    virtual void OnRecord( boost::int64_t time, boost::uint32_t source, const MessagePtr& msg )
+    {
+        Append( time, source, *msg );
+    }
+
+    // false if msg can't be encoded, it is counted as skipped
+    bool Append( boost::int64_t time, boost::uint32_t source, const Message& msg )
+    {
+        if ( !m_Data || !MessageCodec::IsSupported( msg ) ) {
+            m_Skipped.fetch_add( 1, boost::memory_order_relaxed );
+            return false;
+        }
+        for (;;) {
+            size_t room = m_Capacity - m_Used;
+            // keep a zero record header behind the last record
+            if ( room > 2 * sizeof(LogRecordHeader) ) {
+                char* record = m_Data + m_Used;
+                size_t size = MessageCodec::Encode( msg, record + sizeof(LogRecordHeader), room - 2 * sizeof(LogRecordHeader) );
+                if ( size ) {
+                    LogRecordHeader header = { time, source, (boost::uint32_t)size };
+                    std::memcpy( record, &header, sizeof(header) );
+                    m_Used += ( sizeof(header) + size + 7 ) & ~size_t(7);
+                    m_Records.fetch_add( 1, boost::memory_order_relaxed );
+                    return true;
+                }
+            }
+            // larger than a chunk, or a key or type name too long to encode
+            if ( room >= ChunkSize || !Grow( m_Capacity + ChunkSize ) ) {
+                m_Skipped.fetch_add( 1, boost::memory_order_relaxed );
+                return false;
+            }
+        }
+    }
+
+    // unmaps and cuts the file to its records
+    void Close()
+    {
+        if ( !m_Data ) return;
+        m_Region.flush();
+        {
+            boost::interprocess::mapped_region none;
+            m_Region.swap( none );
+        }
+        m_Data = NULL;
+#ifdef __linux__
+        if ( truncate( m_Path.c_str(), (off_t)( m_Used + sizeof(LogRecordHeader) ) ) != 0 ) {}
+#endif
+    }
+
+    boost::uint64_t GetRecordCount() const
+    {
+        return m_Records.load( boost::memory_order_relaxed );
+    }
+
+    // messages MessageCodec can't encode
+    boost::uint64_t GetSkippedCount() const
+    {
+        return m_Skipped.load( boost::memory_order_relaxed );
+    }
+};
+
+/* Reads a log front to back through a read-only mapping.
+ */
+class MessageLogReader
+{
+public:
+    struct Entry
+    {
+        boost::int64_t  m_Time;
+        boost::uint32_t m_Source;
+        MessagePtr      m_Message;
+    };
+
+private:
+    boost::interprocess::mapped_region m_Region;
+    const char*                        m_Data;
+    size_t                             m_Size;
+    size_t                             m_Position;
+    unsigned                           m_DecodeFlags;
+
+    MessageLogReader( const MessageLogReader& );
+    MessageLogReader& operator=( const MessageLogReader& );
+
+public:
+    MessageLogReader() : m_Data(NULL), m_Size(0), m_Position(0), m_DecodeFlags(MessageCodec::DECODE_INTERN) {}
+
+    /* A log holds the keys it saw, so by default unknown names are interned. Recorded state
+     * messages, e.g. TERMINATE, are skipped unless DECODE_STATE is given; a log file may come
+     * from elsewhere. See MessageCodec::DecodeFlags.
+     */
+    void SetDecodeFlags( unsigned flags )
+    {
+        m_DecodeFlags = flags;
+    }
+
+    // false if path is not a message log
+    bool Open( const std::string& path )
+    {
+        try {
+            boost::interprocess::file_mapping mapping( path.c_str(), boost::interprocess::read_only );
+            boost::interprocess::mapped_region region( mapping, boost::interprocess::read_only );
+            m_Region.swap( region );
+        } catch ( const boost::interprocess::interprocess_exception& ) {
+            return false;
+        }
+        m_Data = static_cast< const char* >( m_Region.get_address() );
+        m_Size = m_Region.get_size();
+
+        LogFileHeader header;
+        if ( m_Size < sizeof(header) ) return false;
+        std::memcpy( &header, m_Data, sizeof(header) );
+        if ( std::memcmp( header.m_Magic, "SEQMLOG", 8 ) != 0 || header.m_Version != MessageLogWriter::Version ) return false;
+        m_Position = header.m_HeaderSize;
+        return true;
+    }
+
+    // false at the end of the log; records which don't decode are skipped
+    bool Next( Entry& entry )
+    {
+        while ( m_Data && m_Position + sizeof(LogRecordHeader) <= m_Size ) {
+            LogRecordHeader header;
+            std::memcpy( &header, m_Data + m_Position, sizeof(header) );
+            if ( header.m_Size == 0 || m_Position + sizeof(header) + header.m_Size > m_Size ) return false;
+            const char* data = m_Data + m_Position + sizeof(header);
+            m_Position += ( sizeof(header) + header.m_Size + 7 ) & ~size_t(7);
+
+            entry.m_Message = MessageCodec::Decode( data, header.m_Size, m_DecodeFlags );
+            if ( !entry.m_Message ) continue;
+            entry.m_Time   = header.m_Time;
+            entry.m_Source = header.m_Source;
+            return true;
+        }
+        return false;
+    }
+};
+
+/* Feeds a recorded log into a message queue, usually a Sequencer's, on a thread of its own.
+ * Speed 1 keeps the recorded timing, 2 replays twice as fast, 0 as fast as the queue takes
+ * it. Messages go in in recorded order. With externalOnly, messages recorded from the log's
+ * effects are left out, i.e. the replaying sequencer's effects produce them again. Recorded
+ * state messages are left out unless decodeFlags has DECODE_STATE, so a replay doesn't stop
+ * or pause the target; start the target sequencer yourself. See
+ * MessageLogReader::SetDecodeFlags().
+ */
+class MessageLogReplay
+{
+    MessageLogReader                   m_Reader;
+    MessageQueuePtr                    m_Target;
+    double                             m_Speed;
+    bool                               m_ExternalOnly;
+    boost::atomic<bool>                m_Cancel;
+    // Cancel() wakes a Run() waiting for the next message's time
+    boost::mutex                       m_CancelLock;
+    boost::condition_variable          m_Canceled;
+    boost::atomic< boost::uint64_t >   m_Replayed;
+    boost::scoped_ptr< boost::thread > m_Thread;
+
+    MessageLogReplay( const MessageLogReplay& );
+    MessageLogReplay& operator=( const MessageLogReplay& );
+
+    void Run()
+    {
+        typedef boost::chrono::steady_clock Clock;
+        Clock::time_point start = Clock::now();
+        bool first(true);
+        boost::int64_t origin(0);
+        MessageLogReader::Entry entry;
+        while ( !m_Cancel.load( boost::memory_order_relaxed ) && m_Reader.Next( entry ) ) {
+            if ( m_ExternalOnly && entry.m_Source ) continue;
+            if ( first ) {
+                origin = entry.m_Time;
+                first  = false;
+            }
+            if ( m_Speed > 0 ) {
+                Clock::time_point due = start + boost::chrono::microseconds( (boost::int64_t)( ( entry.m_Time - origin ) / m_Speed ) );
+                boost::mutex::scoped_lock lock(m_CancelLock);
+                while ( !m_Cancel.load( boost::memory_order_relaxed ) ) {
+                    if ( m_Canceled.wait_until( lock, due ) == boost::cv_status::timeout ) break;
+                }
+                if ( m_Cancel.load( boost::memory_order_relaxed ) ) break;
+            }
+            m_Target->Send( entry.m_Message );
+            m_Replayed.fetch_add( 1, boost::memory_order_relaxed );
+        }
+    }
+
+public:
+    MessageLogReplay( const MessageQueuePtr& target, double speed = 1.0, bool externalOnly = false,
+                      unsigned decodeFlags = MessageCodec::DECODE_INTERN )
+        : m_Target(target)
+        , m_Speed(speed)
+        , m_ExternalOnly(externalOnly)
+        , m_Cancel(false)
+        , m_Replayed(0)
+    {
+        m_Reader.SetDecodeFlags( decodeFlags );
+    }
+
+    ~MessageLogReplay()
+    {
+        Cancel();
+        Wait();
+    }
+
+    // false if path is not a message log
+    bool Start( const std::string& path )
+    {
+        if ( m_Thread || !m_Reader.Open( path ) ) return false;
+        m_Thread.reset( new boost::thread( boost::bind( &MessageLogReplay::Run, this ) ) );
+        return true;
+    }
+
+    // until the whole log went out
+    void Wait()
+    {
+        if ( m_Thread && m_Thread->joinable() ) m_Thread->join();
+    }
+
+    // also ends a wait for a message due hours from now
+    void Cancel()
+    {
+        boost::mutex::scoped_lock lock(m_CancelLock);
+        m_Cancel.store( true, boost::memory_order_relaxed );
+        m_Canceled.notify_all();
+    }
+
+    boost::uint64_t GetReplayedCount() const
+    {
+        return m_Replayed.load( boost::memory_order_relaxed );
+    }
+};
+
+#endif /* __MESSAGE_LOG_H__ */
@@ -0,0 +1,151 @@
+#ifndef __MESSAGE_POOL_H__
+#define __MESSAGE_POOL_H__
+
+#include <cstddef>
+#include <new>
+
+#include <boost/thread/tss.hpp>
+#include <boost/lockfree/stack.hpp>
+
+/* Small object allocator for messages. Blocks are grouped in a few size classes and
+ * recycled through per-thread free lists, so allocating and freeing a message normally
+ * does not touch the global heap nor take a lock. A thread whose free list is full (a
+ * consumer releasing what a producer allocated) passes further blocks to a shared lock-free
+ * stack per size class, and a thread whose free list is empty refills from there before
+ * going to the heap, so blocks flow back to the allocating thread. Sizes above the largest
+ * class go to the heap.
+ */
+class MessagePool
+{
+public:
+    enum
+    {
+        ClassCount      = 4,
+        MinBlockSize    = 32,
+        MaxBlockSize    = MinBlockSize << ( ClassCount - 1 ),
+        // blocks kept per size class and thread, the rest goes to the shared stack
+        MaxFreeBlocks   = 256,
+        // blocks kept per size class in the shared stack, the rest goes back to the heap
+        MaxSharedBlocks = 8192,
+        // blocks taken from the shared stack at once by a thread with an empty free list
+        RefillBlocks    = 32
+    };
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock* m_Next;
+    };
+
+    typedef boost::lockfree::stack< FreeBlock*, boost::lockfree::capacity< MaxSharedBlocks > > SharedStack;
+
+    static SharedStack& Shared( size_t index )
+    {
+        // never destroyed, same as the thread caches
+        static SharedStack* shared = new SharedStack[ClassCount];
+        return shared[index];
+    }
+
+    static void Release( FreeBlock* block, size_t index )
+    {
+        if ( !Shared( index ).bounded_push( block ) ) ::operator delete( block );
+    }
+
+    struct ThreadCache
+    {
+        FreeBlock* m_Free[ClassCount];
+        size_t     m_Count[ClassCount];
+
+        ThreadCache()
+        {
+            for ( size_t i = 0; i < ClassCount; ++i ) {
+                m_Free[i]  = NULL;
+                m_Count[i] = 0;
+            }
+        }
+
+        ~ThreadCache()
+        {
+            for ( size_t i = 0; i < ClassCount; ++i ) {
+                while ( m_Free[i] ) {
+                    FreeBlock* block = m_Free[i];
+                    m_Free[i] = block->m_Next;
+                    // hand the blocks of an exiting thread to the others
+                    Release( block, i );
+                }
+            }
+        }
+    };
+
+    static ThreadCache& Cache()
+    {
+        // never destroyed, messages may still be released during static destruction
+        static boost::thread_specific_ptr< ThreadCache >* cache = new boost::thread_specific_ptr< ThreadCache >;
+        ThreadCache* tc = cache->get();
+        if ( !tc ) {
+            tc = new ThreadCache;
+            cache->reset( tc );
+        }
+        return *tc;
+    }
+
+    static size_t SizeClass( size_t size )
+    {
+        size_t index(0);
+        size_t block( MinBlockSize );
+        while ( block < size ) {
+            block <<= 1;
+            ++index;
+        }
+        return index;
+    }
+
+public:
+    static void* Allocate( size_t size )
+    {
+        if ( size > MaxBlockSize ) return ::operator new( size );
+
+        size_t index = SizeClass( size );
+        ThreadCache& tc = Cache();
+        FreeBlock* block = tc.m_Free[index];
+        if ( block ) {
+            tc.m_Free[index] = block->m_Next;
+            --tc.m_Count[index];
+            return block;
+        }
+        SharedStack& shared = Shared( index );
+        if ( shared.pop( block ) ) {
+            // keep a few more for the next allocations
+            FreeBlock* more;
+            while ( tc.m_Count[index] < RefillBlocks && shared.pop( more ) ) {
+                more->m_Next = tc.m_Free[index];
+                tc.m_Free[index] = more;
+                ++tc.m_Count[index];
+            }
+            return block;
+        }
+        return ::operator new( MinBlockSize << index );
+    }
+
+    static void Deallocate( void* p, size_t size )
+    {
+        if ( !p ) return;
+        if ( size > MaxBlockSize ) {
+            ::operator delete( p );
+            return;
+        }
+
+        size_t index = SizeClass( size );
+        ThreadCache& tc = Cache();
+        FreeBlock* block = static_cast<FreeBlock*>( p );
+        if ( tc.m_Count[index] >= MaxFreeBlocks ) {
+            Release( block, index );
+            return;
+        }
+        block->m_Next = tc.m_Free[index];
+        tc.m_Free[index] = block;
+        ++tc.m_Count[index];
+    }
+};
+
+#endif /* __MESSAGE_POOL_H__ */
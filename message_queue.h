@@ -2,33 +2,205 @@
 #define __MSG_QUEUE__
 
 #include <queue>
+#include <list>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <string>
+
+#include "ring_buffer.h"
+#include "message_pool.h"
+#include "metrics.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
 
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/chrono.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/function.hpp>
 
 #include <iostream>
 
+typedef boost::uint32_t MessageKey;
+
+/* Process wide symbol table. Message keys and type names are interned once and
+ * from then on compared as integers. Key 0 is always the empty string.
+ */
+class MessageSymbols
+{
+    typedef boost::unordered_map< std::string, MessageKey > KeyMap;
+
+    mutable boost::mutex       m_Lock;
+    KeyMap                     m_Keys;
+    std::vector< std::string > m_Names;
+
+    MessageSymbols()
+    {
+        m_Keys[""] = 0;
+        m_Names.push_back("");
+    }
+
+    static MessageSymbols& Instance()
+    {
+        static MessageSymbols symbols;
+        return symbols;
+    }
+public:
+    static MessageKey Intern( const std::string& name )
+    {
+        MessageSymbols& symbols = Instance();
+        boost::mutex::scoped_lock lock(symbols.m_Lock);
+        KeyMap::const_iterator it = symbols.m_Keys.find( name );
+        if ( it != symbols.m_Keys.end() ) return it->second;
+
+        MessageKey key = (MessageKey)symbols.m_Names.size();
+        symbols.m_Keys[name] = key;
+        symbols.m_Names.push_back( name );
+        return key;
+    }
+
+    // does not add the name if it is unknown
+    static bool Find( const std::string& name, MessageKey& key )
+    {
+        MessageSymbols& symbols = Instance();
+        boost::mutex::scoped_lock lock(symbols.m_Lock);
+        KeyMap::const_iterator it = symbols.m_Keys.find( name );
+        if ( it == symbols.m_Keys.end() ) return false;
+        key = it->second;
+        return true;
+    }
+
+    // keys are 0 .. GetCount() - 1
+    static size_t GetCount()
+    {
+        MessageSymbols& symbols = Instance();
+        boost::mutex::scoped_lock lock(symbols.m_Lock);
+        return symbols.m_Names.size();
+    }
+
+    // takes the table lock, keep it off hot paths where possible
+    static std::string Name( MessageKey key )
+    {
+        MessageSymbols& symbols = Instance();
+        boost::mutex::scoped_lock lock(symbols.m_Lock);
+        return key < symbols.m_Names.size() ? symbols.m_Names[key] : std::string();
+    }
+};
+
+/* Every message carries an interned key (what asString() used to be compared by) and
+ * an interned type. Subclasses must pass both to the constructor.
+ * Messages are reference counted intrusively (see MessagePtr) and allocated from the
+ * MessagePool.
+ */
 class Message
 {
+    mutable boost::atomic<int> m_RefCount;
+
+protected:
+    MessageKey      m_Key;
+    MessageKey      m_Type;
+    boost::uint32_t m_Flags;
+
 public:
-    Message() {}
+    enum Flags
+    {
+        FLAG_COALESCE = 1,
+        FLAG_CONTROL  = 2,
+        // bits 8-15: data lane, see SetLane()
+        LANE_SHIFT    = 8,
+        LANE_MASK     = 0xff00
+    };
+
+    Message() : m_RefCount(0), m_Key(0), m_Type( Type() ), m_Flags(0) {}
+
+    Message( MessageKey key, MessageKey type ) : m_RefCount(0), m_Key(key), m_Type(type), m_Flags(0) {}
+
+    // a copy is a new object, it does not share the reference count
+    Message( const Message& msg ) : m_RefCount(0), m_Key(msg.m_Key), m_Type(msg.m_Type), m_Flags(msg.m_Flags) {}
+
+    Message& operator=( const Message& msg )
+    {
+        m_Key   = msg.m_Key;
+        m_Type  = msg.m_Type;
+        m_Flags = msg.m_Flags;
+        return *this;
+    }
 
     virtual ~Message() {}
 
-    virtual std::string asString() const { return ""; }
+    static void* operator new( size_t size ) { return MessagePool::Allocate( size ); }
+
+    static void operator delete( void* p, size_t size ) { MessagePool::Deallocate( p, size ); }
+
+    static MessageKey Type()
+    {
+        static const MessageKey type = MessageSymbols::Intern("Message");
+        return type;
+    }
+
+    MessageKey GetKey() const { return m_Key; }
+
+    MessageKey GetType() const { return m_Type; }
+
+    // only the latest value matters: a newer message of the same key may replace this one
+    // while it is still queued, see MessageQueueT::SetCoalescing()
+    void SetCoalescable( bool coalesce )
+    {
+        m_Flags = coalesce ? ( m_Flags | FLAG_COALESCE ) : ( m_Flags & ~FLAG_COALESCE );
+    }
+
+    bool IsCoalescable() const { return ( m_Flags & FLAG_COALESCE ) != 0; }
+
+    // queued ahead of all data, e.g. the sequencer's state messages
+    void SetControl( bool control )
+    {
+        m_Flags = control ? ( m_Flags | FLAG_CONTROL ) : ( m_Flags & ~FLAG_CONTROL );
+    }
+
+    bool IsControl() const { return ( m_Flags & FLAG_CONTROL ) != 0; }
+
+    // data lane 0-255, see MessageQueueT::SetLaneWeights(); 0 is the default lane
+    void SetLane( unsigned lane )
+    {
+        m_Flags = ( m_Flags & ~LANE_MASK ) | ( ( lane << LANE_SHIFT ) & LANE_MASK );
+    }
+
+    unsigned GetLane() const { return ( m_Flags & LANE_MASK ) >> LANE_SHIFT; }
+
+    virtual std::string asString() const { return MessageSymbols::Name( m_Key ); }
 
     template <class T> T as() { return dynamic_cast<T>(this); }
 
+    // type check without RTTI, T must provide a static Type()
+    template <class T> T* Cast()
+    {
+        return m_Type == T::Type() ? static_cast<T*>(this) : NULL;
+    }
+
+    template <class T> const T* Cast() const
+    {
+        return m_Type == T::Type() ? static_cast<const T*>(this) : NULL;
+    }
+
     virtual bool operator==( const char* val )
     {
-        return asString() == val;
+        MessageKey key;
+        return MessageSymbols::Find( val, key ) && key == m_Key;
     }
 
     virtual bool operator==( const Message& msg )
     {
-        return asString() == msg.asString();
+        return m_Key == msg.m_Key;
     }
 
     virtual bool operator!=( const Message& msg )
@@ -36,127 +208,911 @@ public:
         // make sure != && == are equivalent
         return ! this->operator==( msg );
     }
+
+    friend void intrusive_ptr_add_ref( const Message* msg )
+    {
+        msg->m_RefCount.fetch_add( 1, boost::memory_order_relaxed );
+    }
+
+    friend void intrusive_ptr_release( const Message* msg )
+    {
+        if ( msg->m_RefCount.fetch_sub( 1, boost::memory_order_release ) == 1 ) {
+            boost::atomic_thread_fence( boost::memory_order_acquire );
+            delete msg;
+        }
+    }
 };
-typedef boost::shared_ptr< Message > MessagePtr;
+typedef boost::intrusive_ptr< Message > MessagePtr;
 
 class StringMessage : public Message
 {
     std::string m_Body;
 public:
-    StringMessage( const char* val ) : m_Body(val) {}
+    StringMessage( const char* val ) : Message( MessageSymbols::Intern(val), Type() ), m_Body(val) {}
 
     virtual ~StringMessage() {}
 
+    static MessageKey Type()
+    {
+        static const MessageKey type = MessageSymbols::Intern("StringMessage");
+        return type;
+    }
+
     virtual std::string asString() const { return m_Body; }
 };
 
+/* Multi-producer, single-consumer message queue.
+ * Any thread may Send, but only one thread at a time may Poll/Wait. Messages go into a
+ * bounded lock-free ring buffer; the mutex is only taken to park an idle consumer or to
+ * spill into the overflow queue while the ring is full (e.g. the consumer thread sending
+ * to its own queue from a listener).
+ * Masked Poll/Wait do a selective receive: messages which do not match are moved to a
+ * consumer side pending list, indexed by key, and stay there in arrival order for later
+ * Poll/Wait calls.
+ * What happens once the ring is full is up to the OverflowPolicy; by default the queue
+ * keeps growing through the overflow queue.
+ * With SetCoalescing(true) a coalescable message replaces a still queued message of the
+ * same key in place. It travels through the ring as a CoalesceToken which holds the key's
+ * latest message until the consumer takes it.
+ */
 template<typename T>
 class MessageQueueT
 {
+public:
+    typedef boost::intrusive_ptr<T> ValuePtr;
+    typedef std::vector< ValuePtr > ValueList;
+
+    // one Send as queued; the same message may be queued by several Sends at once
+    struct Entry
+    {
+        ValuePtr        m_Value;
+        // MetricsClock::Stamp() | 1 at Send, 0 if not stamped, see SetStamping()
+        boost::uint32_t m_Stamp;
+        // id of the sending effect, see SeqEffect::GetSourceId(); 0 for anything else
+        boost::uint32_t m_Source;
+
+        Entry() : m_Stamp(0), m_Source(0) {}
+        Entry( const ValuePtr& value, boost::uint32_t stamp, boost::uint32_t source = 0 ) : m_Value(value), m_Stamp(stamp), m_Source(source) {}
+    };
+    typedef std::vector< Entry > EntryList;
+
+    enum { DefaultCapacity = 4096, DefaultBlockTimeoutMs = 100, ControlCapacity = 256 };
+
+    enum OverflowPolicy
+    {
+        OVERFLOW_GROW,          // spill into the unbounded overflow queue
+        OVERFLOW_BLOCK,         // producers wait for room, see SetBlockTimeout(); not for timed effects
+        OVERFLOW_DROP_NEWEST,   // the message being sent is dropped
+        OVERFLOW_DROP_OLDEST,   // the oldest queued message is dropped
+        OVERFLOW_COALESCE       // replaces a spilled message of the same key, else spills up to SetSpillLimit()
+    };
+
+    // how Wait() waits for an empty queue, see SetWaitStrategy()
+    enum WaitStrategy
+    {
+        WAIT_BLOCK,             // parks on the condition variable right away
+        WAIT_SPIN_PARK,         // spins, then yields, then parks
+        WAIT_BUSY_SPIN          // never parks, keeps a core busy
+    };
+
+    enum { DefaultSpinCount = 1000, DefaultYieldCount = 100 };
+
+    // SendBatch() claims ring cells for up to this many messages at once
+    enum { BatchChunk = 64 };
+
+    struct QueueStats
+    {
+        boost::uint64_t m_Dropped;
+        boost::uint64_t m_Coalesced;
+        // number of Sends which had to wait, and for how long in total
+        boost::uint64_t m_Blocked;
+        boost::uint64_t m_BlockedUs;
+    };
+
 private:
-    std::queue< typename boost::shared_ptr<T> >  m_Queue;
+    typedef boost::shared_ptr< RingBuffer< Entry > > LanePtr;
+
+    // control messages, always taken before any data
+    RingBuffer< Entry >       m_Control;
+    // control messages while m_Control is full, under m_Lock; never subject to the overflow policy
+    std::deque< Entry >       m_ControlOverflow;
+    boost::atomic<bool>       m_ControlSpilled;
+    // lane 0
+    RingBuffer< Entry >       m_Ring;
+    // lanes 1.. and the weights of all lanes, empty unless SetLaneWeights() was called
+    std::vector< LanePtr >    m_Lanes;
+    std::vector< unsigned >   m_LaneWeights;
+    // consumer side: lane being served and what is left of its turn
+    size_t                    m_LaneCursor;
+    unsigned                  m_LaneCredit;
+    // only used while the ring is full, keeps FIFO order until drained
+    std::deque< Entry >       m_Overflow;
+    boost::atomic<bool>       m_Spilled;
+    // OVERFLOW_COALESCE: absolute position of each key's message in m_Overflow
+    typedef boost::unordered_map< MessageKey, boost::uint64_t > OverflowIndex;
+    OverflowIndex             m_OverflowByKey;
+    boost::uint64_t           m_OverflowHead;
+
+    OverflowPolicy            m_Policy;
+    unsigned                  m_BlockTimeoutMs;
+    // OVERFLOW_COALESCE: most keys m_Overflow holds
+    size_t                    m_SpillLimit;
+    // thread which last waited on the queue, it must never block on itself
+    boost::atomic<size_t>     m_Consumer;
+    boost::atomic<unsigned>   m_BlockedProducers;
+    boost::condition_variable m_NotFull;
+
+    boost::atomic< boost::uint64_t > m_Dropped;
+    boost::atomic< boost::uint64_t > m_Coalesced;
+    boost::atomic< boost::uint64_t > m_Blocked;
+    boost::atomic< boost::uint64_t > m_BlockedUs;
+
+    // queued in place of the latest coalescable message of a key
+    class CoalesceToken : public T
+    {
+    public:
+        ValuePtr        m_Value;
+        // stamp and source of the Send which set m_Value
+        boost::uint32_t m_Stamp;
+        boost::uint32_t m_Source;
+        // under m_CoalesceLock: the push succeeded, updates may replace m_Value from now on
+        bool            m_Queued;
+
+        CoalesceToken( const Entry& entry ) : T( entry.m_Value->GetKey(), Type() ), m_Value(entry.m_Value), m_Stamp(entry.m_Stamp), m_Source(entry.m_Source), m_Queued(false) {}
+
+        static MessageKey Type()
+        {
+            static const MessageKey type = MessageSymbols::Intern("CoalesceToken");
+            return type;
+        }
+    };
+    typedef boost::unordered_map< MessageKey, CoalesceToken* > CoalesceIndex;
+
+    bool                      m_CoalesceEnabled;
+    // m_Lock may be held when taking it, not the other way round
+    boost::mutex              m_CoalesceLock;
+    // keys with a token in the queue
+    CoalesceIndex             m_Coalescing;
+    // consumer side only: messages skipped by a masked Poll/Wait, oldest first
+    struct PendingEntry
+    {
+        boost::uint64_t m_Seq;
+        Entry           m_Entry;
+    };
+    typedef std::list< PendingEntry >                                   PendingList;
+    typedef boost::unordered_map< MessageKey,
+                                  std::deque< typename PendingList::iterator > > PendingIndex;
+
+    PendingList               m_Pending;
+    PendingIndex              m_PendingByKey;
+    boost::uint64_t           m_PendingSeq;
+    // the control messages of m_Pending, oldest first; taken before any other pending message
+    std::deque< typename PendingList::iterator > m_PendingControl;
+
     mutable boost::mutex      m_Lock;
     boost::condition_variable m_ConditionVar;
-    bool                      m_CancelWait;
+    boost::atomic<bool>       m_Waiting;
+    boost::atomic<bool>       m_CancelWait;
+    boost::atomic<bool>       m_Stamping;
+    WaitStrategy              m_WaitStrategy;
+    unsigned                  m_SpinCount;
+    unsigned                  m_YieldCount;
+    // optional readiness notification, see EnableEventFd()
+    int                       m_EventFd;
+    boost::atomic<bool>       m_EventFdArmed;
+    // replaces the consumer wakeup, see SetDispatcher()
+    boost::function< void () > m_Dispatcher;
 protected:
     struct compareMsgPtr
     {
-        boost::shared_ptr<T> val;
-        compareMsgPtr( boost::shared_ptr<T> t )  : val(t) {}
-        bool operator()( const boost::shared_ptr<T>& a ) {
-            bool b = *a == *val;
-            return b;
+        ValuePtr val;
+        compareMsgPtr( ValuePtr t )  : val(t) {}
+        bool operator()( const ValuePtr& a ) {
+            return a->GetKey() == val->GetKey();
         }
     };
 
-public:
-    MessageQueueT()
-        : m_CancelWait(false)
-    {}
-
-    void Send( boost::shared_ptr<T> const& data)
+    static size_t CurrentThread()
     {
-        m_Lock.lock();
-        m_CancelWait = false;
-        if ( data ) m_Queue.push(data);
-        m_Lock.unlock();
-        m_ConditionVar.notify_one();
+        return hash_value( boost::this_thread::get_id() );
     }
 
-    bool IsEmpty() const
+    // to the control lane, a data lane or lane 0; false if dropped
+    bool Route( const Entry& entry )
     {
-        boost::mutex::scoped_lock lock(m_Lock);
-        return m_Queue.empty();
+        const ValuePtr& data = entry.m_Value;
+        if ( data->IsControl() ) {
+            if ( !m_ControlSpilled.load( boost::memory_order_acquire ) && m_Control.Push( entry ) ) return true;
+            boost::mutex::scoped_lock lock(m_Lock);
+            m_ControlOverflow.push_back( entry );
+            m_ControlSpilled.store( true, boost::memory_order_release );
+            return true;
+        }
+        // a full data lane leaves the message to lane 0 and its overflow policy
+        unsigned lane = data->GetLane();
+        if ( lane && lane <= m_Lanes.size() && m_Lanes[ lane - 1 ]->Push( entry ) ) return true;
+        return ( m_CoalesceEnabled && data->IsCoalescable() ) ? PushCoalescing( entry ) : Push( entry );
     }
 
-    void CancelWait()
+    // lane 0; returns false if the message got dropped
+    bool Push( const Entry& entry )
     {
-        m_CancelWait = true;
-        m_ConditionVar.notify_one();
+        if ( !m_Spilled.load( boost::memory_order_acquire ) && m_Ring.Push( entry ) ) {
+            return true;
+        }
+        switch ( m_Policy ) {
+        case OVERFLOW_BLOCK:
+            // the consumer would wait for itself
+            if ( m_Consumer.load( boost::memory_order_relaxed ) != CurrentThread() ) return PushBlocking( entry );
+            break;
+        case OVERFLOW_DROP_NEWEST:
+            m_Dropped.fetch_add( 1, boost::memory_order_relaxed );
+            return false;
+        case OVERFLOW_DROP_OLDEST:
+            if ( !m_Spilled.load( boost::memory_order_acquire ) ) {
+                Entry oldest;
+                while ( !m_Ring.Push( entry ) ) {
+                    if ( m_Ring.Pop( oldest ) ) {
+                        TakeToken( oldest );
+                        m_Dropped.fetch_add( 1, boost::memory_order_relaxed );
+                    }
+                }
+                return true;
+            }
+            break;
+        default:
+            break;
+        }
+        return Spill( entry );
     }
 
-    boost::shared_ptr<T> Poll( std::vector< typename  boost::shared_ptr<T> > mask, bool equal = true )
+    // false if dropped: OVERFLOW_COALESCE and a new key while the spill limit is reached
+    bool Spill( const Entry& entry )
     {
         boost::mutex::scoped_lock lock(m_Lock);
-        if (!m_Queue.empty() )
+        if ( m_Policy == OVERFLOW_COALESCE ) {
+            MessageKey key = entry.m_Value->GetKey();
+            typename OverflowIndex::iterator it = m_OverflowByKey.find( key );
+            if ( it != m_OverflowByKey.end() ) {
+                // newer message of the same key takes the queued one's place
+                Entry& queued = m_Overflow[ it->second - m_OverflowHead ];
+                TakeToken( queued );
+                queued = entry;
+                m_Coalesced.fetch_add( 1, boost::memory_order_relaxed );
+                return true;
+            }
+            if ( m_Overflow.size() >= m_SpillLimit ) {
+                m_Dropped.fetch_add( 1, boost::memory_order_relaxed );
+                return false;
+            }
+            m_OverflowByKey.insert( std::make_pair( key, m_OverflowHead + m_Overflow.size() ) );
+        }
+        m_Overflow.push_back( entry );
+        m_Spilled.store( true, boost::memory_order_release );
+        return true;
+    }
+
+    bool PushBlocking( const Entry& entry )
+    {
+        boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+        boost::chrono::steady_clock::time_point end = start + boost::chrono::milliseconds( m_BlockTimeoutMs );
+        bool pushed(false);
         {
-            boost::shared_ptr<T> value = m_Queue.front();
-            typename std::vector< boost::shared_ptr<T> >::iterator it = std::find_if( mask.begin(), mask.end(), compareMsgPtr(value));
-            if ( (it != mask.end()) == equal ) {
-                m_Queue.pop();
-                return value;
+            boost::mutex::scoped_lock lock(m_Lock);
+            m_BlockedProducers.fetch_add( 1, boost::memory_order_relaxed );
+            boost::atomic_thread_fence( boost::memory_order_seq_cst );
+            while ( !( pushed = ( !m_Spilled.load( boost::memory_order_acquire ) && m_Ring.Push( entry ) ) ) ) {
+                if ( m_NotFull.wait_until( lock, end ) == boost::cv_status::timeout ) break;
             }
+            m_BlockedProducers.fetch_sub( 1, boost::memory_order_relaxed );
         }
-        return boost::shared_ptr<T>();
+        m_Blocked.fetch_add( 1, boost::memory_order_relaxed );
+        m_BlockedUs.fetch_add( boost::chrono::duration_cast< boost::chrono::microseconds >( boost::chrono::steady_clock::now() - start ).count(), boost::memory_order_relaxed );
+        if ( !pushed ) m_Dropped.fetch_add( 1, boost::memory_order_relaxed );
+        return pushed;
     }
 
-    boost::shared_ptr<T> Poll( )
+    bool PushCoalescing( const Entry& entry )
     {
-        boost::mutex::scoped_lock lock(m_Lock);
-        if (m_Queue.empty() )
+        Entry token;
+        MessageKey key = entry.m_Value->GetKey();
+        for (;;) {
+            boost::mutex::scoped_lock lock(m_CoalesceLock);
+            typename CoalesceIndex::iterator it = m_Coalescing.find( key );
+            if ( it == m_Coalescing.end() ) {
+                CoalesceToken* newToken = new CoalesceToken( entry );
+                m_Coalescing[ key ] = newToken;
+                token = Entry( newToken, entry.m_Stamp, entry.m_Source );
+                break;
+            }
+            if ( it->second->m_Queued ) {
+                it->second->m_Value = entry.m_Value;
+                it->second->m_Stamp = entry.m_Stamp;
+                it->second->m_Source = entry.m_Source;
+                m_Coalesced.fetch_add( 1, boost::memory_order_relaxed );
+                return true;
+            }
+            // another producer is still pushing the token, and the overflow policy may drop it
+            lock.unlock();
+            boost::this_thread::yield();
+        }
+        if ( !Push( token ) ) {
+            // Push counted it as dropped
+            TakeToken( token );
+            return false;
+        }
+        boost::mutex::scoped_lock lock(m_CoalesceLock);
+        static_cast< CoalesceToken* >( token.m_Value.get() )->m_Queued = true;
+        return true;
+    }
+
+    // replaces a token by the message it holds, the key is no longer coalesced
+    void TakeToken( Entry& entry )
+    {
+        if ( !entry.m_Value || entry.m_Value->GetType() != CoalesceToken::Type() ) return;
+        CoalesceToken* token = static_cast< CoalesceToken* >( entry.m_Value.get() );
+        ValuePtr latest;
         {
-            return boost::shared_ptr<T>();
+            boost::mutex::scoped_lock lock(m_CoalesceLock);
+            typename CoalesceIndex::iterator it = m_Coalescing.find( token->GetKey() );
+            if ( it != m_Coalescing.end() && it->second == token ) m_Coalescing.erase( it );
+            latest.swap( token->m_Value );
+            entry.m_Stamp = token->m_Stamp;
+            entry.m_Source = token->m_Source;
         }
+        entry.m_Value.swap( latest );
+    }
 
-        boost::shared_ptr<T> value = m_Queue.front();
-        m_Queue.pop();
-        return value;
+    // consumer made room; cheap if nobody is blocked
+    void NotifyProducers()
+    {
+        boost::atomic_thread_fence( boost::memory_order_seq_cst );
+        if ( m_BlockedProducers.load( boost::memory_order_relaxed ) ) {
+            m_Lock.lock();
+            m_Lock.unlock();
+            m_NotFull.notify_all();
+        }
     }
 
-    boost::shared_ptr<T> Wait( std::vector< typename boost::shared_ptr<T> > mask, bool equal = true )
+    bool PopControl( Entry& entry )
     {
-        do {
-            boost::mutex::scoped_lock lock(m_Lock);
-            while (m_Queue.empty() && !m_CancelWait)
-            {
-                m_ConditionVar.wait(lock);
+        if ( !m_Control.IsEmpty() && m_Control.Pop( entry ) ) return true;
+        if ( !m_ControlSpilled.load( boost::memory_order_acquire ) ) return false;
+        boost::mutex::scoped_lock lock(m_Lock);
+        if ( m_ControlOverflow.empty() ) return false;
+        entry = m_ControlOverflow.front();
+        m_ControlOverflow.pop_front();
+        if ( m_ControlOverflow.empty() ) m_ControlSpilled.store( false, boost::memory_order_release );
+        return true;
+    }
+
+    // next control message, else the next data message by lane weight; ignores the pending list
+    bool PopIncoming( Entry& entry )
+    {
+        if ( PopControl( entry ) ) return true;
+        if ( m_Lanes.empty() ) return PopLane( 0, entry );
+        // weighted round robin: a lane is served for up to its weight, an empty lane passes on
+        for ( size_t i = 0; i <= m_LaneWeights.size(); ++i ) {
+            if ( m_LaneCredit && PopLane( m_LaneCursor, entry ) ) {
+                --m_LaneCredit;
+                return true;
             }
-            if ( !m_CancelWait ) {
-                boost::shared_ptr<T> value = m_Queue.front();
-                typename std::vector< boost::shared_ptr<T> >::iterator it = std::find_if( mask.begin(), mask.end(), compareMsgPtr(value));
-                if ( (it != mask.end()) == equal ) {
-                    m_Queue.pop();
-                    return value;
+            m_LaneCursor = ( m_LaneCursor + 1 ) % m_LaneWeights.size();
+            m_LaneCredit = m_LaneWeights[ m_LaneCursor ];
+        }
+        return false;
+    }
+
+    bool PopLane( size_t lane, Entry& entry )
+    {
+        if ( lane ) return m_Lanes[ lane - 1 ]->Pop( entry );
+        if ( m_Ring.Pop( entry ) ) {
+            if ( m_Policy == OVERFLOW_BLOCK ) NotifyProducers();
+            TakeToken( entry );
+            return true;
+        }
+        if ( m_Spilled.load( boost::memory_order_acquire ) ) {
+            boost::mutex::scoped_lock lock(m_Lock);
+            if ( !m_Overflow.empty() ) {
+                entry = m_Overflow.front();
+                m_Overflow.pop_front();
+                if ( !m_OverflowByKey.empty() ) {
+                    typename OverflowIndex::iterator it = m_OverflowByKey.find( entry.m_Value->GetKey() );
+                    if ( it != m_OverflowByKey.end() && it->second == m_OverflowHead ) m_OverflowByKey.erase( it );
                 }
+                ++m_OverflowHead;
+                if ( m_Overflow.empty() ) {
+                    m_Spilled.store( false, boost::memory_order_release );
+                    m_NotFull.notify_all();
+                }
+                TakeToken( entry );
+                return true;
             }
-        } while (!m_CancelWait);
+        }
+        return false;
+    }
 
-        return boost::shared_ptr<T>();
+    bool Pop( Entry& entry )
+    {
+        if ( PopControl( entry ) ) return true;
+        if ( !m_PendingControl.empty() ) {
+            TakePending( m_PendingControl.front(), entry );
+            return true;
+        }
+        if ( !m_Pending.empty() ) {
+            TakePending( m_Pending.begin(), entry );
+            return true;
+        }
+        return PopIncoming( entry );
     }
 
-    boost::shared_ptr<T> Wait()
+    void AddPending( const Entry& entry )
     {
+        PendingEntry pending = { m_PendingSeq++, entry };
+        m_Pending.push_back( pending );
+        m_PendingByKey[ entry.m_Value->GetKey() ].push_back( --m_Pending.end() );
+        if ( entry.m_Value->IsControl() ) m_PendingControl.push_back( --m_Pending.end() );
+    }
+
+    // usually the oldest pending message of its key, a control message may overtake data of its key
+    void TakePending( typename PendingList::iterator it, Entry& entry )
+    {
+        entry = it->m_Entry;
+        typename PendingIndex::iterator keyIt = m_PendingByKey.find( entry.m_Value->GetKey() );
+        keyIt->second.erase( std::find( keyIt->second.begin(), keyIt->second.end(), it ) );
+        if ( keyIt->second.empty() ) m_PendingByKey.erase( keyIt );
+        if ( entry.m_Value->IsControl() ) {
+            m_PendingControl.erase( std::find( m_PendingControl.begin(), m_PendingControl.end(), it ) );
+        }
+        m_Pending.erase( it );
+    }
+
+    bool Matches( const ValuePtr& value, const std::vector< ValuePtr >& mask, bool equal ) const
+    {
+        typename std::vector< ValuePtr >::const_iterator it = std::find_if( mask.begin(), mask.end(), compareMsgPtr(value));
+        return (it != mask.end()) == equal;
+    }
+
+    // oldest pending message which matches the mask
+    bool TakePending( const std::vector< ValuePtr >& mask, bool equal, Entry& entry )
+    {
+        if ( m_Pending.empty() ) return false;
+        for ( size_t i = 0; i < m_PendingControl.size(); ++i ) {
+            if ( Matches( m_PendingControl[i]->m_Entry.m_Value, mask, equal ) ) {
+                TakePending( m_PendingControl[i], entry );
+                return true;
+            }
+        }
+        if ( equal ) {
+            // look at the head of each masked key's sub-queue only
+            typename PendingList::iterator oldest = m_Pending.end();
+            for ( typename std::vector< ValuePtr >::const_iterator m = mask.begin(); m != mask.end(); ++m ) {
+                typename PendingIndex::iterator keyIt = m_PendingByKey.find( (*m)->GetKey() );
+                if ( keyIt == m_PendingByKey.end() ) continue;
+                typename PendingList::iterator head = keyIt->second.front();
+                if ( oldest == m_Pending.end() || head->m_Seq < oldest->m_Seq ) oldest = head;
+            }
+            if ( oldest == m_Pending.end() ) return false;
+            TakePending( oldest, entry );
+            return true;
+        }
+        for ( typename PendingList::iterator it = m_Pending.begin(); it != m_Pending.end(); ++it ) {
+            if ( Matches( it->m_Entry.m_Value, mask, false ) ) {
+                TakePending( it, entry );
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool HasIncoming() const
+    {
+        if ( !m_Control.IsEmpty() || m_ControlSpilled.load( boost::memory_order_acquire ) ) return true;
+        if ( !m_Ring.IsEmpty() || m_Spilled.load( boost::memory_order_acquire ) ) return true;
+        for ( size_t i = 0; i < m_Lanes.size(); ++i ) {
+            if ( !m_Lanes[i]->IsEmpty() ) return true;
+        }
+        return false;
+    }
+
+    bool HasPending() const
+    {
+        return !m_Pending.empty() || HasIncoming();
+    }
+
+    static void CpuRelax()
+    {
+#if defined(__GNUC__) && ( defined(__i386__) || defined(__x86_64__) )
+        __builtin_ia32_pause();
+#endif
+    }
+
+    // wakes a parked consumer; cheap if nobody is waiting
+    void Notify()
+    {
+        boost::atomic_thread_fence( boost::memory_order_seq_cst );
+        if ( m_Dispatcher ) {
+            m_Dispatcher();
+            return;
+        }
+        if ( m_EventFdArmed.load( boost::memory_order_relaxed ) && m_EventFdArmed.exchange( false ) ) {
+#ifdef __linux__
+            boost::uint64_t one(1);
+            if ( write( m_EventFd, &one, sizeof(one) ) != sizeof(one) ) {}
+#endif
+        }
+        if ( m_Waiting.load( boost::memory_order_relaxed ) ) {
+            // taking the lock orders us after the consumer's last check before it sleeps
+            m_Lock.lock();
+            m_Lock.unlock();
+            m_ConditionVar.notify_one();
+        }
+    }
+
+    /* Blocks until something is pending or the wait got canceled. Returns false if canceled.
+     * With incomingOnly the pending list is ignored, i.e. it waits for new messages.
+     */
+    bool Park( bool incomingOnly = false )
+    {
+        if ( m_WaitStrategy != WAIT_BLOCK ) {
+            for ( unsigned i = 0; ; ++i ) {
+                if ( m_CancelWait.load( boost::memory_order_relaxed ) ) return false;
+                if ( incomingOnly ? HasIncoming() : HasPending() ) return true;
+                if ( m_WaitStrategy == WAIT_BUSY_SPIN || i < m_SpinCount ) {
+                    CpuRelax();
+                } else if ( i < m_SpinCount + m_YieldCount ) {
+                    boost::this_thread::yield();
+                } else {
+                    break;
+                }
+            }
+        }
         boost::mutex::scoped_lock lock(m_Lock);
-        while (m_Queue.empty() && !m_CancelWait)
+        m_Waiting.store( true, boost::memory_order_relaxed );
+        boost::atomic_thread_fence( boost::memory_order_seq_cst );
+        while ( !m_CancelWait.load( boost::memory_order_relaxed ) && !( incomingOnly ? HasIncoming() : HasPending() ) )
         {
             m_ConditionVar.wait(lock);
         }
-        if (!m_CancelWait) {
-            boost::shared_ptr<T> value = m_Queue.front();
-            m_Queue.pop();
-            return value;
+        m_Waiting.store( false, boost::memory_order_relaxed );
+        return !m_CancelWait.load( boost::memory_order_relaxed );
+    }
+
+public:
+    MessageQueueT( size_t capacity = DefaultCapacity, OverflowPolicy policy = OVERFLOW_GROW )
+        : m_Control( ControlCapacity )
+        , m_ControlSpilled(false)
+        , m_Ring( capacity )
+        , m_LaneCursor(0)
+        , m_LaneCredit(0)
+        , m_Spilled(false)
+        , m_OverflowHead(0)
+        , m_Policy(policy)
+        , m_BlockTimeoutMs(DefaultBlockTimeoutMs)
+        , m_SpillLimit( m_Ring.Capacity() )
+        , m_Consumer(0)
+        , m_BlockedProducers(0)
+        , m_Dropped(0)
+        , m_Coalesced(0)
+        , m_Blocked(0)
+        , m_BlockedUs(0)
+        , m_CoalesceEnabled(false)
+        , m_PendingSeq(0)
+        , m_Waiting(false)
+        , m_CancelWait(false)
+        , m_Stamping(false)
+        , m_WaitStrategy(WAIT_BLOCK)
+        , m_SpinCount(DefaultSpinCount)
+        , m_YieldCount(DefaultYieldCount)
+        , m_EventFd(-1)
+        , m_EventFdArmed(false)
+    {}
+
+    ~MessageQueueT()
+    {
+#ifdef __linux__
+        if ( m_EventFd >= 0 ) close( m_EventFd );
+#endif
+    }
+
+    // returns false if the message got dropped by the overflow policy; source see Entry::m_Source
+    bool Send( ValuePtr const& data, boost::uint32_t source = 0 )
+    {
+        m_CancelWait.store( false, boost::memory_order_relaxed );
+        bool sent = data && Route( Entry( data, m_Stamping.load( boost::memory_order_relaxed ) ? MetricsClock::Stamp() | 1 : 0, source ) );
+        Notify();
+        return sent;
+    }
+
+    /* Sends all of batch (no NULLs) with one claim on the ring per BatchChunk messages and a
+     * single consumer wakeup, returns the number of messages queued. Whatever does not fit
+     * goes through the overflow policy one by one, as does everything while coalescing is
+     * enabled.
+     */
+    size_t SendBatch( const ValueList& batch )
+    {
+        if ( batch.empty() ) return 0;
+        m_CancelWait.store( false, boost::memory_order_relaxed );
+        boost::uint32_t stamp = m_Stamping.load( boost::memory_order_relaxed ) ? MetricsClock::Stamp() | 1 : 0;
+        size_t pushed(0);
+        if ( !m_CoalesceEnabled && !m_Spilled.load( boost::memory_order_acquire ) ) {
+            // the leading run of plain lane 0 messages goes in with one claim per chunk
+            size_t plain(0);
+            while ( plain < batch.size() && !batch[plain]->IsControl() && !batch[plain]->GetLane() ) ++plain;
+            Entry chunk[BatchChunk];
+            while ( pushed < plain ) {
+                size_t count = std::min( plain - pushed, size_t( BatchChunk ) );
+                for ( size_t i = 0; i < count; ++i ) chunk[i] = Entry( batch[ pushed + i ], stamp );
+                size_t claimed = m_Ring.PushBatch( chunk, count );
+                pushed += claimed;
+                if ( claimed < count ) break;
+            }
+        }
+        size_t sent( pushed );
+        for ( size_t i = pushed; i < batch.size(); ++i ) {
+            if ( Route( Entry( batch[i], stamp ) ) ) ++sent;
+        }
+        Notify();
+        return sent;
+    }
+
+    /* Splits data into weighted lanes, set before the queue is used. Lane i (see
+     * Message::SetLane()) gets weights[i] messages per round while the others have
+     * messages queued, lane 0 being the default lane with the queue's capacity and overflow
+     * policy. Lanes 1.. are lock-free rings of laneCapacity; messages for a full lane, or a
+     * lane not configured, go to lane 0. Control messages always come first regardless.
+     */
+    void SetLaneWeights( const std::vector< unsigned >& weights, size_t laneCapacity = DefaultCapacity )
+    {
+        m_Lanes.clear();
+        m_LaneWeights.clear();
+        for ( size_t i = 0; i < weights.size(); ++i ) {
+            m_LaneWeights.push_back( std::max( weights[i], 1u ) );
+            if ( i ) m_Lanes.push_back( LanePtr( new RingBuffer< Entry >( laneCapacity ) ) );
+        }
+        if ( m_Lanes.empty() ) m_LaneWeights.clear();
+        m_LaneCursor = 0;
+        m_LaneCredit = m_LaneWeights.empty() ? 0 : m_LaneWeights[0];
+    }
+
+    // lets coalescable messages replace queued ones of the same key; set before the queue is used
+    void SetCoalescing( bool coalesce )
+    {
+        m_CoalesceEnabled = coalesce;
+    }
+
+    bool IsCoalescing() const
+    {
+        return m_CoalesceEnabled;
+    }
+
+    // set before the queue is used
+    void SetOverflowPolicy( OverflowPolicy policy )
+    {
+        m_Policy = policy;
+    }
+
+    OverflowPolicy GetOverflowPolicy() const
+    {
+        return m_Policy;
+    }
+
+    /* OVERFLOW_BLOCK: longest a Send waits before the message is dropped. A producer may
+     * hold a lock the consumer needs (e.g. the timing wheel's), so it never waits forever.
+     */
+    void SetBlockTimeout( unsigned ms )
+    {
+        m_BlockTimeoutMs = ms;
+    }
+
+    size_t Capacity() const
+    {
+        return m_Ring.Capacity();
+    }
+
+    /* OVERFLOW_COALESCE: distinct keys the overflow takes while the ring is full, the
+     * capacity by default; a Send of another key is dropped. Set before the queue is used.
+     */
+    void SetSpillLimit( size_t limit )
+    {
+        m_SpillLimit = limit;
+    }
+
+    /* Set before the queue is used. WAIT_SPIN_PARK polls spinCount times, then yields
+     * yieldCount times before it parks; a message arriving meanwhile costs no wakeup.
+     * WAIT_BUSY_SPIN trades a core for the lowest latency, CancelWait() still ends it.
+     */
+    void SetWaitStrategy( WaitStrategy strategy, unsigned spinCount = DefaultSpinCount, unsigned yieldCount = DefaultYieldCount )
+    {
+        m_WaitStrategy = strategy;
+        m_SpinCount    = spinCount;
+        m_YieldCount   = yieldCount;
+    }
+
+    WaitStrategy GetWaitStrategy() const
+    {
+        return m_WaitStrategy;
+    }
+
+    /* Creates an eventfd which becomes readable when a message arrives on an empty queue,
+     * so the queue can be polled from epoll or an asio reactor instead of Wait(). Returns
+     * the descriptor, -1 if not supported; the queue owns it. Only armed queues signal it,
+     * one write per wakeup, not per message. The consumer loop:
+     *
+     *     for (;;) {
+     *         // wait for fd readable (epoll, asio posix::stream_descriptor::async_wait, ...)
+     *         queue->ResetEventFd();
+     *         do { while ( queue->PollBatch( batch, 64 ) ) ...; } while ( !queue->ArmEventFd() );
+     *     }
+     */
+    int EnableEventFd()
+    {
+#ifdef __linux__
+        if ( m_EventFd < 0 ) m_EventFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        if ( m_EventFd >= 0 ) ArmEventFd();
+#endif
+        return m_EventFd;
+    }
+
+    int GetEventFd() const
+    {
+        return m_EventFd;
+    }
+
+    /* Consumer, once the queue has been drained: the next send signals the eventfd.
+     * Returns false if messages arrived meanwhile, i.e. drain again instead of waiting.
+     */
+    bool ArmEventFd()
+    {
+        if ( m_EventFd < 0 ) return false;
+        m_EventFdArmed.store( true, boost::memory_order_relaxed );
+        boost::atomic_thread_fence( boost::memory_order_seq_cst );
+        if ( !HasPending() ) return true;
+        m_EventFdArmed.store( false, boost::memory_order_relaxed );
+        return false;
+    }
+
+    // consumer, after the eventfd became readable
+    void ResetEventFd()
+    {
+#ifdef __linux__
+        boost::uint64_t count;
+        if ( m_EventFd >= 0 && read( m_EventFd, &count, sizeof(count) ) != sizeof(count) ) {}
+#endif
+    }
+
+    // stamps every Send with the time, see Entry::m_Stamp
+    void SetStamping( bool stamping )
+    {
+        m_Stamping.store( stamping, boost::memory_order_relaxed );
+    }
+
+    /* For a consumer without a thread of its own: called after every send in place of
+     * waking Wait(), e.g. to post a drain handler to an event loop. The dispatcher runs on
+     * the sending thread, after the message is visible to Poll(). Set it before the first
+     * send, it is not synchronized with producers.
+     */
+    void SetDispatcher( const boost::function< void () >& dispatcher )
+    {
+        m_Dispatcher = dispatcher;
+    }
+
+    // the calling thread consumes from now on; Wait() does this implicitly
+    void SetConsumer()
+    {
+        m_Consumer.store( CurrentThread(), boost::memory_order_relaxed );
+    }
+
+    // queued messages, consumer thread only; a hint while producers are active
+    size_t Size() const
+    {
+        size_t size = m_Control.Size() + m_Ring.Size() + m_Pending.size();
+        for ( size_t i = 0; i < m_Lanes.size(); ++i ) size += m_Lanes[i]->Size();
+        if ( m_Spilled.load( boost::memory_order_acquire ) || m_ControlSpilled.load( boost::memory_order_acquire ) ) {
+            boost::mutex::scoped_lock lock(m_Lock);
+            size += m_Overflow.size() + m_ControlOverflow.size();
+        }
+        return size;
+    }
+
+    QueueStats GetStats() const
+    {
+        QueueStats stats;
+        stats.m_Dropped   = m_Dropped.load( boost::memory_order_relaxed );
+        stats.m_Coalesced = m_Coalesced.load( boost::memory_order_relaxed );
+        stats.m_Blocked   = m_Blocked.load( boost::memory_order_relaxed );
+        stats.m_BlockedUs = m_BlockedUs.load( boost::memory_order_relaxed );
+        return stats;
+    }
+
+    bool IsEmpty() const
+    {
+        return !HasPending();
+    }
+
+    void CancelWait()
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        m_CancelWait = true;
+        m_ConditionVar.notify_all();
+    }
+
+    // oldest message whose key is (equal) or is not (!equal) in mask, others stay queued
+    ValuePtr Poll( const std::vector< ValuePtr >& mask, bool equal = true )
+    {
+        Entry entry;
+        if ( TakePending( mask, equal, entry ) ) return entry.m_Value;
+        while ( PopIncoming( entry ) ) {
+            if ( Matches( entry.m_Value, mask, equal ) ) return entry.m_Value;
+            AddPending( entry );
+        }
+        return ValuePtr();
+    }
+
+    ValuePtr Poll( )
+    {
+        Entry entry;
+        Pop( entry );
+        return entry.m_Value;
+    }
+
+    // appends up to max pending messages to out, returns the number of messages taken
+    size_t PollBatch( ValueList& out, size_t max )
+    {
+        size_t count(0);
+        Entry entry;
+        while ( count < max && Pop( entry ) ) {
+            out.push_back( entry.m_Value );
+            ++count;
+        }
+        return count;
+    }
+
+    // as above, with what the queue knows about each Send
+    size_t PollBatch( EntryList& out, size_t max )
+    {
+        size_t count(0);
+        Entry entry;
+        while ( count < max && Pop( entry ) ) {
+            out.push_back( entry );
+            ++count;
+        }
+        return count;
+    }
+
+    size_t DrainAll( ValueList& out )
+    {
+        return PollBatch( out, size_t(-1) );
+    }
+
+    ValuePtr Wait( const std::vector< ValuePtr >& mask, bool equal = true )
+    {
+        m_Consumer.store( CurrentThread(), boost::memory_order_relaxed );
+        if ( m_CancelWait.load( boost::memory_order_relaxed ) ) return ValuePtr();
+        ValuePtr value = Poll( mask, equal );
+        // everything already queued has been looked at, only new messages can match
+        while ( !value && Park( true ) ) {
+            value = Poll( mask, equal );
+        }
+        return value;
+    }
+
+    ValuePtr Wait()
+    {
+        Entry entry;
+        Wait( entry );
+        return entry.m_Value;
+    }
+
+    // false if canceled
+    bool Wait( Entry& entry )
+    {
+        m_Consumer.store( CurrentThread(), boost::memory_order_relaxed );
+        while ( Park() )
+        {
+            if ( Pop( entry ) ) return true;
         }
-        return boost::shared_ptr<T>();
+        return false;
     }
 
 };
@@ -0,0 +1,260 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/chrono.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+// send stamps, see MessageQueueT::SetStamping()
+struct MetricsClock
+{
+    // steady clock nanoseconds, truncated; differences are valid for about four seconds
+    static boost::uint32_t Stamp()
+    {
+        return (boost::uint32_t)boost::chrono::duration_cast< boost::chrono::nanoseconds >(
+            boost::chrono::steady_clock::now().time_since_epoch() ).count();
+    }
+};
+
+/* Counter owned by one thread. The owner updates it with a plain load and store, no locked
+ * instruction, any thread may read it.
+ */
+class MetricsCounter
+{
+    boost::atomic< boost::uint64_t > m_Value;
+
+    MetricsCounter( const MetricsCounter& );
+    MetricsCounter& operator=( const MetricsCounter& );
+public:
+    MetricsCounter() : m_Value(0) {}
+
+    // owning thread only
+    void Add( boost::uint64_t n = 1 )
+    {
+        m_Value.store( m_Value.load( boost::memory_order_relaxed ) + n, boost::memory_order_relaxed );
+    }
+
+    boost::uint64_t Get() const
+    {
+        return m_Value.load( boost::memory_order_relaxed );
+    }
+};
+
+struct HistogramSummary
+{
+    boost::uint64_t m_Count;
+    boost::uint64_t m_Sum;
+    boost::uint64_t m_Max;
+    boost::uint64_t m_P50;
+    boost::uint64_t m_P90;
+    boost::uint64_t m_P99;
+    boost::uint64_t m_P999;
+};
+
+/* Log-linear (HDR style) histogram. Values below SubBuckets are counted exactly, above
+ * that each power of two is split into SubBuckets buckets, percentiles are within ~2%.
+ * Recording is an index computation plus plain stores to a bucket, the sum and the max;
+ * like MetricsCounter a histogram has a single writing thread.
+ */
+class LatencyHistogram
+{
+public:
+    enum
+    {
+        SubBits     = 5,
+        SubBuckets  = 1 << SubBits,
+        BucketCount = ( 64 - SubBits + 1 ) * SubBuckets
+    };
+
+private:
+    boost::atomic< boost::uint64_t > m_Buckets[BucketCount];
+    MetricsCounter                   m_Sum;
+    boost::atomic< boost::uint64_t > m_Max;
+
+    LatencyHistogram( const LatencyHistogram& );
+    LatencyHistogram& operator=( const LatencyHistogram& );
+
+    static unsigned Log2( boost::uint64_t value )
+    {
+#ifdef __GNUC__
+        return 63 - __builtin_clzll( value );
+#else
+        unsigned log(0);
+        while ( value >>= 1 ) ++log;
+        return log;
+#endif
+    }
+
+    static size_t Index( boost::uint64_t value )
+    {
+        if ( value < SubBuckets ) return (size_t)value;
+        unsigned shift = Log2( value ) - SubBits;
+        return ( shift + 1 ) * SubBuckets + (size_t)( ( value >> shift ) & ( SubBuckets - 1 ) );
+    }
+
+    // middle of the bucket's range
+    static boost::uint64_t Value( size_t index )
+    {
+        if ( index < SubBuckets ) return index;
+        unsigned shift = (unsigned)( index / SubBuckets ) - 1;
+        boost::uint64_t lower = (boost::uint64_t)( SubBuckets + index % SubBuckets ) << shift;
+        return lower + ( ( (boost::uint64_t)1 << shift ) >> 1 );
+    }
+
+public:
+    LatencyHistogram() : m_Max(0)
+    {
+        for ( size_t i = 0; i < BucketCount; ++i ) m_Buckets[i].store( 0, boost::memory_order_relaxed );
+    }
+
+    // owning thread only
+    void Record( boost::uint64_t value )
+    {
+        boost::atomic< boost::uint64_t >& bucket = m_Buckets[ Index( value ) ];
+        bucket.store( bucket.load( boost::memory_order_relaxed ) + 1, boost::memory_order_relaxed );
+        m_Sum.Add( value );
+        if ( value > m_Max.load( boost::memory_order_relaxed ) ) m_Max.store( value, boost::memory_order_relaxed );
+    }
+
+    // any thread; concurrent records may or may not be included
+    HistogramSummary Summarize() const
+    {
+        HistogramSummary summary;
+        summary.m_Sum = m_Sum.Get();
+        summary.m_Max = m_Max.load( boost::memory_order_relaxed );
+
+        std::vector< boost::uint64_t > counts( BucketCount );
+        boost::uint64_t total(0);
+        for ( size_t i = 0; i < BucketCount; ++i ) {
+            counts[i] = m_Buckets[i].load( boost::memory_order_relaxed );
+            total += counts[i];
+        }
+        summary.m_Count = total;
+
+        const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+        boost::uint64_t* results[] = { &summary.m_P50, &summary.m_P90, &summary.m_P99, &summary.m_P999 };
+        boost::uint64_t seen(0);
+        size_t index(0);
+        for ( size_t q = 0; q < 4; ++q ) {
+            boost::uint64_t rank = std::max( (boost::uint64_t)1, (boost::uint64_t)( quantiles[q] * total + 0.5 ) );
+            while ( index < BucketCount && seen + counts[index] < rank ) seen += counts[index++];
+            *results[q] = total ? std::min( Value( index ), summary.m_Max ) : 0;
+        }
+        return summary;
+    }
+};
+
+/* Prometheus text exposition format.
+ */
+class PrometheusWriter
+{
+    std::ostringstream m_Out;
+
+public:
+    // starts a metric family, type is "counter", "gauge" or "summary"
+    void Family( const char* name, const char* type, const char* help )
+    {
+        m_Out << "# HELP " << name << ' ' << help << '\n' << "# TYPE " << name << ' ' << type << '\n';
+    }
+
+    // labels without braces, e.g. "effect=\"3\""
+    void Sample( const char* name, double value, const std::string& labels = std::string() )
+    {
+        m_Out << name;
+        if ( !labels.empty() ) m_Out << '{' << labels << '}';
+        m_Out << ' ' << value << '\n';
+    }
+
+    // scale converts the recorded unit, e.g. 1e-9 for nanoseconds to seconds
+    void Summary( const char* name, const char* help, const HistogramSummary& summary, double scale = 1.0 )
+    {
+        Family( name, "summary", help );
+        Sample( name, summary.m_P50  * scale, "quantile=\"0.5\"" );
+        Sample( name, summary.m_P90  * scale, "quantile=\"0.9\"" );
+        Sample( name, summary.m_P99  * scale, "quantile=\"0.99\"" );
+        Sample( name, summary.m_P999 * scale, "quantile=\"0.999\"" );
+        Sample( ( std::string( name ) + "_sum" ).c_str(), summary.m_Sum * scale );
+        Sample( ( std::string( name ) + "_count" ).c_str(), (double)summary.m_Count );
+    }
+
+    std::string Str() const
+    {
+        return m_Out.str();
+    }
+};
+
+/* Writes a metrics text to a file every interval, on its own thread. The file is replaced
+ * atomically (write and rename) so a scraper never sees half of it.
+ */
+class MetricsDumper
+{
+public:
+    typedef boost::function< std::string () > Source;
+
+private:
+    Source                             m_Source;
+    std::string                        m_Path;
+    unsigned                           m_IntervalMs;
+    boost::mutex                       m_Lock;
+    boost::condition_variable          m_ConditionVar;
+    bool                               m_Stop;
+    boost::scoped_ptr< boost::thread > m_Thread;
+
+    MetricsDumper( const MetricsDumper& );
+    MetricsDumper& operator=( const MetricsDumper& );
+
+    void Write()
+    {
+        std::string text = m_Source();
+        std::string tmp = m_Path + ".tmp";
+        FILE* file = fopen( tmp.c_str(), "w" );
+        if ( !file ) return;
+        fwrite( text.data(), 1, text.size(), file );
+        fclose( file );
+        std::rename( tmp.c_str(), m_Path.c_str() );
+    }
+
+    void DumpThread()
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        while ( !m_Stop ) {
+            m_ConditionVar.timed_wait( lock, boost::posix_time::milliseconds( (long)m_IntervalMs ) );
+            lock.unlock();
+            Write();
+            lock.lock();
+        }
+    }
+
+public:
+    MetricsDumper( const Source& source, const std::string& path, unsigned intervalMs )
+        : m_Source(source)
+        , m_Path(path)
+        , m_IntervalMs(intervalMs)
+        , m_Stop(false)
+    {
+        m_Thread.reset( new boost::thread( boost::bind( &MetricsDumper::DumpThread, this ) ) );
+    }
+
+    // writes once more on the way out
+    ~MetricsDumper()
+    {
+        {
+            boost::mutex::scoped_lock lock(m_Lock);
+            m_Stop = true;
+            m_ConditionVar.notify_all();
+        }
+        m_Thread->join();
+    }
+};
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,145 @@
+#ifndef __RING_BUFFER_H__
+#define __RING_BUFFER_H__
+
+#include <cstddef>
+
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+
+/* Bounded lock-free ring buffer (sequenced cells, see D. Vyukov's bounded MPMC queue).
+ * Any number of threads may Push, a Push costs one CAS on the tail. Pop also claims
+ * its cell with a CAS so the consumer side may be shared, but MessageQueueT only ever
+ * has a single consumer. Capacity is rounded up to the next power of two.
+ */
+template<typename T>
+class RingBuffer
+{
+    struct Cell
+    {
+        boost::atomic<size_t> m_Sequence;
+        T                     m_Data;
+    };
+
+    enum { CacheLine = 64 };
+
+    boost::scoped_array<Cell> m_Cells;
+    size_t                    m_Mask;
+    char                      m_Pad0[CacheLine];
+    boost::atomic<size_t>     m_Tail;
+    char                      m_Pad1[CacheLine];
+    boost::atomic<size_t>     m_Head;
+    char                      m_Pad2[CacheLine];
+
+    RingBuffer( const RingBuffer& );
+    RingBuffer& operator=( const RingBuffer& );
+
+public:
+    explicit RingBuffer( size_t capacity = 1024 )
+        : m_Mask(0)
+        , m_Tail(0)
+        , m_Head(0)
+    {
+        size_t size = 2;
+        while ( size < capacity ) size <<= 1;
+        m_Mask = size - 1;
+        m_Cells.reset( new Cell[size] );
+        for ( size_t i = 0; i < size; ++i ) {
+            m_Cells[i].m_Sequence.store( i, boost::memory_order_relaxed );
+        }
+    }
+
+    size_t Capacity() const { return m_Mask + 1; }
+
+    // returns false if the buffer is full
+    bool Push( const T& data )
+    {
+        Cell* cell;
+        size_t pos = m_Tail.load( boost::memory_order_relaxed );
+        for (;;) {
+            cell = &m_Cells[ pos & m_Mask ];
+            size_t seq = cell->m_Sequence.load( boost::memory_order_acquire );
+            std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+            if ( diff == 0 ) {
+                if ( m_Tail.compare_exchange_weak( pos, pos + 1, boost::memory_order_relaxed ) ) break;
+            } else if ( diff < 0 ) {
+                return false;
+            } else {
+                pos = m_Tail.load( boost::memory_order_relaxed );
+            }
+        }
+        cell->m_Data = data;
+        cell->m_Sequence.store( pos + 1, boost::memory_order_release );
+        return true;
+    }
+
+    /* Pushes the longest prefix of data that fits with a single CAS on the tail, returns
+     * its length. The cells are published in order.
+     */
+    size_t PushBatch( const T* data, size_t count )
+    {
+        size_t pos = m_Tail.load( boost::memory_order_relaxed );
+        for (;;) {
+            size_t free(0);
+            while ( free < count && m_Cells[ ( pos + free ) & m_Mask ].m_Sequence.load( boost::memory_order_acquire ) == pos + free ) {
+                ++free;
+            }
+            if ( free == 0 ) {
+                // full, unless another producer got here first
+                size_t tail = m_Tail.load( boost::memory_order_relaxed );
+                if ( tail == pos ) return 0;
+                pos = tail;
+                continue;
+            }
+            if ( m_Tail.compare_exchange_weak( pos, pos + free, boost::memory_order_relaxed ) ) {
+                for ( size_t i = 0; i < free; ++i ) {
+                    Cell* cell = &m_Cells[ ( pos + i ) & m_Mask ];
+                    cell->m_Data = data[i];
+                    cell->m_Sequence.store( pos + i + 1, boost::memory_order_release );
+                }
+                return free;
+            }
+        }
+    }
+
+    // returns false if the buffer is empty
+    bool Pop( T& data )
+    {
+        Cell* cell;
+        size_t pos = m_Head.load( boost::memory_order_relaxed );
+        for (;;) {
+            cell = &m_Cells[ pos & m_Mask ];
+            size_t seq = cell->m_Sequence.load( boost::memory_order_acquire );
+            std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos + 1);
+            if ( diff == 0 ) {
+                if ( m_Head.compare_exchange_weak( pos, pos + 1, boost::memory_order_relaxed ) ) break;
+            } else if ( diff < 0 ) {
+                return false;
+            } else {
+                pos = m_Head.load( boost::memory_order_relaxed );
+            }
+        }
+        data = cell->m_Data;
+        // drop our reference right away, the slot may sit idle for a long time
+        cell->m_Data = T();
+        cell->m_Sequence.store( pos + m_Mask + 1, boost::memory_order_release );
+        return true;
+    }
+
+    // only a hint while producers are active
+    bool IsEmpty() const
+    {
+        size_t pos = m_Head.load( boost::memory_order_relaxed );
+        size_t seq = m_Cells[ pos & m_Mask ].m_Sequence.load( boost::memory_order_acquire );
+        return seq != pos + 1;
+    }
+
+    // number of claimed cells, some may still be in the middle of a Push
+    size_t Size() const
+    {
+        size_t head = m_Head.load( boost::memory_order_relaxed );
+        size_t tail = m_Tail.load( boost::memory_order_relaxed );
+        return tail - head;
+    }
+};
+
+#endif /* __RING_BUFFER_H__ */
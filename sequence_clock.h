@@ -0,0 +1,71 @@
+#ifndef __SEQUENCE_CLOCK_H__
+#define __SEQUENCE_CLOCK_H__
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/chrono.hpp>
+
+class SeqClock;
+typedef boost::shared_ptr< SeqClock > SeqClockPtr;
+
+/* Time base of a Sequencer, in microseconds since the clock was created.
+ */
+class SeqClock
+{
+public:
+    virtual ~SeqClock() {}
+
+    virtual boost::int64_t Now() const = 0;
+
+    // a simulated clock only moves when the sequencer advances it
+    virtual bool IsSimulated() const { return false; }
+
+    virtual void AdvanceTo( boost::int64_t time ) {}
+};
+
+// the default, monotonic wall time
+class SeqRealTimeClock : public SeqClock
+{
+public:
+    typedef boost::chrono::steady_clock Clock;
+
+private:
+    Clock::time_point m_Start;
+
+public:
+    SeqRealTimeClock() : m_Start( Clock::now() ) {}
+
+    virtual boost::int64_t Now() const
+    {
+        return boost::chrono::duration_cast< boost::chrono::microseconds >( Clock::now() - m_Start ).count();
+    }
+};
+
+/* Virtual time. Whenever the sequencer has nothing left to do at the current time (its
+ * message queue ran empty) it moves the clock straight to the next timer deadline, so a
+ * sequence runs as fast as the CPU allows, in the same order as in real time.
+ */
+class SeqSimulatedClock : public SeqClock
+{
+    boost::atomic< boost::int64_t > m_Now;
+
+public:
+    SeqSimulatedClock( boost::int64_t start = 0 ) : m_Now(start) {}
+
+    virtual boost::int64_t Now() const
+    {
+        return m_Now.load( boost::memory_order_acquire );
+    }
+
+    virtual bool IsSimulated() const { return true; }
+
+    // never goes backwards
+    virtual void AdvanceTo( boost::int64_t time )
+    {
+        boost::int64_t now = m_Now.load( boost::memory_order_relaxed );
+        while ( now < time && !m_Now.compare_exchange_weak( now, time, boost::memory_order_release ) ) {}
+    }
+};
+
+#endif /* __SEQUENCE_CLOCK_H__ */
@@ -0,0 +1,227 @@
+#ifndef __SEQUENCE_COROUTINE_EFFECT_H__
+#define __SEQUENCE_COROUTINE_EFFECT_H__
+
+#include "message_queue.h"
+#include "sequence_effect.h"
+#include "sequencer.h"
+#include "timing_wheel.h"
+
+#include <boost/asio/coroutine.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+/* Effect written as a stackless coroutine (boost::asio::coroutine). Run() is re-entered
+ * after each wait, so multi-step behavior needs neither a hand written state machine nor
+ * an extra effect and listener per step. Keep the coroutine's locals in members:
+ *
+ *     virtual void Run()
+ *     {
+ *         BOOST_ASIO_CORO_REENTER( m_Coro ) {
+ *             for ( m_Step = 0; m_Step < 3; ++m_Step ) {
+ *                 BOOST_ASIO_CORO_YIELD Delay( 200 );
+ *                 Send( m_Blink );
+ *                 BOOST_ASIO_CORO_YIELD WaitEvent( m_Ack->GetKey() );
+ *             }
+ *         }
+ *     }
+ *
+ * The state lives in the effect itself, a wait costs no allocation: Delay() re-uses the
+ * effect's timing wheel entry and WaitEvent() the sequencer's one-shot waiter table. Run()
+ * resumes on the service thread after Delay() and on the message thread after WaitEvent().
+ * When the body completes the effect notifies, i.e. repeats like any other effect; a
+ * repeat runs from the io_service, so a body which never waits doesn't recurse.
+ *
+ * Locks: m_Lock before the wheel's and the sequencer's waiter lock. The timer callback runs
+ * under the wheel's lock and only try-locks m_Lock.
+ */
+class SeqCoroutineEffect : public SeqEffect, protected Sequencer::EventWaiter
+{
+    // a restart posted to the io_service may outlive the effect
+    struct PostGuard
+    {
+        boost::mutex        m_Lock;
+        SeqCoroutineEffect* m_Effect;
+
+        PostGuard( SeqCoroutineEffect* effect ) : m_Effect(effect) {}
+    };
+    typedef boost::shared_ptr< PostGuard > PostGuardPtr;
+
+    static void PostedResume( const PostGuardPtr& guard, unsigned generation )
+    {
+        boost::mutex::scoped_lock lock(guard->m_Lock);
+        if ( guard->m_Effect ) guard->m_Effect->Resume( generation );
+    }
+
+protected:
+    boost::asio::coroutine  m_Coro;
+    Sequencer*              m_Sequencer;
+    TimingWheel::Entry      m_TimerEntry;
+    // absolute, in Sequencer::GetTime() microseconds
+    boost::int64_t          m_Deadline;
+    // key WaitEvent() waits for, and the message that ended the wait
+    MessageKey              m_WaitKey;
+    bool                    m_Waiting;
+    MessagePtr              m_Event;
+
+    // serializes Run() with Stop()
+    boost::recursive_mutex  m_Lock;
+    bool                    m_Stopped;
+    // Resume() is running the body
+    bool                    m_Resuming;
+    // bumped by Start() and Stop(); a timer or restart of an earlier run is dropped
+    unsigned                m_Generation;
+    unsigned                m_TimerGeneration;
+    PostGuardPtr            m_PostGuard;
+
+public:
+    SeqCoroutineEffect( int repeat = 0, const MessageQueuePtr& msgQueue = MessageQueuePtr() )
+        : SeqEffect( msgQueue, repeat )
+        , m_Sequencer(NULL)
+        , m_Deadline(0)
+        , m_WaitKey(0)
+        , m_Waiting(false)
+        , m_Stopped(true)
+        , m_Resuming(false)
+        , m_Generation(0)
+        , m_TimerGeneration(0)
+        , m_PostGuard( new PostGuard( this ) )
+    {
+    }
+
+    virtual ~SeqCoroutineEffect()
+    {
+        {
+            boost::mutex::scoped_lock lock(m_PostGuard->m_Lock);
+            m_PostGuard->m_Effect = NULL;
+        }
+        Stop();
+    }
+
+    virtual void Init( Sequencer *sequencer )
+    {
+        if ( sequencer ) {
+            m_Sequencer = sequencer;
+            m_TimerEntry.SetCallback( boost::bind( &SeqCoroutineEffect::OnTimer, this ) );
+        }
+    }
+
+    virtual bool Start()
+    {
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        m_Coro    = boost::asio::coroutine();
+        m_Stopped = false;
+        ++m_Generation;
+        m_Event.reset();
+        if ( m_Sequencer ) m_Deadline = m_Sequencer->GetTime();
+        if ( m_Resuming && m_Sequencer ) {
+            // repeating from Notify() in Resume()
+            m_Sequencer->GetIOService().post( boost::bind( &SeqCoroutineEffect::PostedResume, m_PostGuard, m_Generation ) );
+        } else {
+            Resume();
+        }
+        return true;
+    }
+
+    virtual void Stop()
+    {
+        {
+            boost::recursive_mutex::scoped_lock lock(m_Lock);
+            m_Stopped = true;
+            ++m_Generation;
+        }
+        // a callback in progress finishes first, it won't schedule anything after m_Stopped
+        m_TimerEntry.Cancel();
+        CancelWaitEvent();
+        SeqEffect::Stop();
+    }
+
+protected:
+    // the coroutine body
+    virtual void Run() = 0;
+
+    // resume after ms milliseconds; delays add up without drift
+    void Delay( double ms )
+    {
+        if ( !m_Sequencer ) return;
+        m_Deadline += (boost::int64_t)( ms * 1000.0 + 0.5 );
+        m_TimerGeneration = m_Generation;
+        m_Sequencer->ScheduleAt( m_TimerEntry, m_Deadline );
+    }
+
+    // resume with the next message with key, see GetEvent()
+    void WaitEvent( MessageKey key )
+    {
+        if ( !m_Sequencer ) return;
+        m_WaitKey = key;
+        m_Waiting = true;
+        m_Sequencer->WaitEvent( key, this );
+    }
+
+    const MessagePtr& GetEvent() const
+    {
+        return m_Event;
+    }
+
+    void Resume()
+    {
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        if ( m_Stopped ) return;
+        bool resuming = m_Resuming;
+        m_Resuming = true;
+        Run();
+        if ( m_Coro.is_complete() ) {
+            m_Stopped = true;
+            Notify();
+        }
+        m_Resuming = resuming;
+    }
+
+    void Resume( unsigned generation )
+    {
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        if ( generation == m_Generation ) Resume();
+    }
+
+    // service thread, under the wheel's lock
+    void OnTimer()
+    {
+        boost::recursive_mutex::scoped_try_lock lock(m_Lock);
+        if ( !lock.owns_lock() ) {
+            // Start() or Stop() in progress, look again next tick
+            m_Sequencer->ScheduleAt( m_TimerEntry, m_Sequencer->GetTime() );
+            return;
+        }
+        if ( m_TimerGeneration == m_Generation ) Resume();
+    }
+
+    // message thread
+    virtual void OnWaitEvent( const MessagePtr& msg )
+    {
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        if ( !m_Waiting ) return;
+        m_Waiting = false;
+        m_Event   = msg;
+        // the wait may have been long, delays count from here
+        m_Deadline = m_Sequencer->GetTime();
+        Resume();
+    }
+
+    // not under m_Lock unless from Run(): CancelEventWait() waits for an OnWaitEvent() in progress
+    void CancelWaitEvent()
+    {
+        MessageKey key;
+        {
+            boost::recursive_mutex::scoped_lock lock(m_Lock);
+            if ( !m_Waiting ) return;
+            m_Waiting = false;
+            key = m_WaitKey;
+        }
+        m_Sequencer->CancelEventWait( key, this );
+    }
+};
+
+#endif /* __SEQUENCE_COROUTINE_EFFECT_H__ */
@@ -23,13 +23,20 @@ class SeqEffect
 protected:
     MessageQueuePtr m_MessageQueue;
     int             m_RepeatCounter;
+    boost::atomic< boost::uint64_t > m_NotifyCount;
+    boost::uint32_t m_SourceId;
+    // fired by the sequencer's EffectGraph instead of its own listener
+    boost::atomic<bool> m_GraphDriven;
 
 public:
-    SeqEffect( int repeat = 0 ) : m_RepeatCounter(repeat) {}
+    SeqEffect( int repeat = 0 ) : m_RepeatCounter(repeat), m_NotifyCount(0), m_SourceId(0), m_GraphDriven(false) {}
 
     SeqEffect( const MessageQueuePtr& msgQueue, int repeat = 0 )
         : m_MessageQueue(msgQueue)
         , m_RepeatCounter(repeat)
+        , m_NotifyCount(0)
+        , m_SourceId(0)
+        , m_GraphDriven(false)
     {
     }
 
@@ -50,6 +57,12 @@ public:
         return m_MessageQueue;
     }
 
+    // key of the message that triggers this effect, if any
+    virtual bool GetTriggerKey( MessageKey& key ) const { return false; }
+
+    // key of the message this effect sends, if any
+    virtual bool GetOutputKey( MessageKey& key ) const { return false; }
+
     virtual bool Start()
     {
         return true;
@@ -59,9 +72,48 @@ public:
     {
     }
 
+    // tags the messages the effect sends, Sequencer::Add() numbers effects from 1
+    void SetSourceId( boost::uint32_t id )
+    {
+        m_SourceId = id;
+    }
+
+    boost::uint32_t GetSourceId() const
+    {
+        return m_SourceId;
+    }
+
+    // fires the effect as if its trigger message arrived, see GetTriggerKey()
+    virtual void Trigger()
+    {
+        Notify();
+    }
+
+    void SetGraphDriven( bool graph )
+    {
+        m_GraphDriven.store( graph, boost::memory_order_release );
+    }
+
+    bool IsGraphDriven() const
+    {
+        return m_GraphDriven.load( boost::memory_order_acquire );
+    }
+
+    // number of times the effect fired
+    boost::uint64_t GetNotifyCount() const
+    {
+        return m_NotifyCount.load( boost::memory_order_relaxed );
+    }
+
 protected:
+    void Send( const MessagePtr& msg )
+    {
+        m_MessageQueue->Send( msg, m_SourceId );
+    }
+
     virtual void Notify()
     {
+        m_NotifyCount.fetch_add( 1, boost::memory_order_relaxed );
         OnNotify();
         if ( m_RepeatCounter < 0 ) {
             Start();
@@ -4,6 +4,7 @@
 #include "message_queue.h"
 #include "listener.h"
 #include "sequence_effect.h"
+#include "trace.h"
 
 #include <string>
 
@@ -39,6 +40,18 @@ public:
         }
     }
 
+    virtual bool GetTriggerKey( MessageKey& key ) const
+    {
+        key = m_MessageToListen->GetKey();
+        return true;
+    }
+
+    virtual bool GetOutputKey( MessageKey& key ) const
+    {
+        key = m_Message->GetKey();
+        return true;
+    }
+
     virtual bool Start()
     {
         return true;
@@ -52,14 +65,16 @@ public:
 protected:
     virtual bool OnEvent( const MessagePtr& msg )
     {
+        // the sequencer's effect graph fires it
+        if ( IsGraphDriven() ) return true;
         Notify();
         return true;
     }
 
     virtual void OnNotify()
     {
-        std::cout << "SeqEventEffect::OnNotify: " << m_Message->asString() << std::endl;
-        m_MessageQueue->Send( m_Message );
+        SEQ_TRACE( Tracer::TRACE_EFFECTS, Tracer::KIND_EVENT_NOTIFY, m_Message->GetKey(), m_RepeatCounter );
+        Send( m_Message );
     }
 
 };
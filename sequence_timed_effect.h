@@ -3,27 +3,80 @@
 
 #include "message_queue.h"
 #include "sequence_effect.h"
+#include "sequencer.h"
+#include "timing_wheel.h"
+#include "trace.h"
 
 #include <string>
 
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/function.hpp>
 #include <boost/asio.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+/* Sends a message after m_Time milliseconds, repeatedly if asked to. Repeats are scheduled
+ * against absolute deadlines on the sequencer's monotonic clock (deadline += period), so
+ * the latency of a notification does not add up over the repeats.
+ */
 class SeqTimedEffect : public SeqEffect
 {
+public:
+    // what to do with periods that are already over when re-arming, i.e. when we fell behind
+    enum CatchUpPolicy
+    {
+        CATCHUP_FIRE_ALL,   // fire every missed period, back to back
+        CATCHUP_COALESCE,   // fire once for all missed periods
+        CATCHUP_SKIP        // drop missed periods, continue with the next one
+    };
+
+    // lateness of the notifications in microseconds
+    struct LatenessStats
+    {
+        boost::int64_t m_Count;
+        boost::int64_t m_Total;
+        boost::int64_t m_Max;
+        boost::int64_t m_Last;
+        // periods coalesced or skipped
+        boost::int64_t m_Missed;
+    };
+
 protected:
     double              m_Time;
     MessagePtr          m_Message;
 
-    Sequencer::TimerPtr m_Timer;
+    // fires on the sequencer's timing wheel instead of an asio timer of its own
+    Sequencer*          m_Sequencer;
+    TimingWheel::Entry  m_TimerEntry;
+
+    CatchUpPolicy       m_CatchUp;
+    // absolute, in Sequencer::GetTime() microseconds
+    boost::int64_t      m_Deadline;
+    // true while notifying from the timer, Start() then re-arms relative to m_Deadline
+    bool                m_Firing;
+
+    // written on the service thread only
+    boost::atomic< boost::int64_t > m_LateCount;
+    boost::atomic< boost::int64_t > m_LateTotal;
+    boost::atomic< boost::int64_t > m_LateMax;
+    boost::atomic< boost::int64_t > m_LateLast;
+    boost::atomic< boost::int64_t > m_Missed;
 public:
     SeqTimedEffect( double t, const MessagePtr& msg, int repeat = 0, const MessageQueuePtr& msgQueue = MessageQueuePtr() )
         : SeqEffect(msgQueue, repeat )
         , m_Time(t)
         , m_Message(msg)
+        , m_Sequencer(NULL)
+        , m_CatchUp(CATCHUP_FIRE_ALL)
+        , m_Deadline(0)
+        , m_Firing(false)
+        , m_LateCount(0)
+        , m_LateTotal(0)
+        , m_LateMax(0)
+        , m_LateLast(0)
+        , m_Missed(0)
     {
     }
 
@@ -35,32 +88,105 @@ public:
     virtual void Init( Sequencer *sequencer )
     {
         if ( sequencer ) {
-        	m_Timer  = sequencer->CreateTimer();
+            m_Sequencer = sequencer;
+            m_TimerEntry.SetCallback( boost::bind( &SeqTimedEffect::OnTimer, this ) );
         }
     }
 
+    virtual bool GetOutputKey( MessageKey& key ) const
+    {
+        key = m_Message->GetKey();
+        return true;
+    }
+
+    void SetCatchUp( CatchUpPolicy policy )
+    {
+        m_CatchUp = policy;
+    }
+
+    CatchUpPolicy GetCatchUp() const
+    {
+        return m_CatchUp;
+    }
+
+    LatenessStats GetLateness() const
+    {
+        LatenessStats stats;
+        stats.m_Count  = m_LateCount.load( boost::memory_order_relaxed );
+        stats.m_Total  = m_LateTotal.load( boost::memory_order_relaxed );
+        stats.m_Max    = m_LateMax.load( boost::memory_order_relaxed );
+        stats.m_Last   = m_LateLast.load( boost::memory_order_relaxed );
+        stats.m_Missed = m_Missed.load( boost::memory_order_relaxed );
+        return stats;
+    }
+
     bool Start()
     {
         SeqEffect::Start();
-        if ( m_Timer ) {
-        	m_Timer->expires_from_now( boost::posix_time::milliseconds(m_Time));
-        	m_Timer->async_wait( boost::bind(&SeqTimedEffect::Notify, this));
+        if ( m_Sequencer ) {
+            boost::int64_t period = (boost::int64_t)( m_Time * 1000.0 + 0.5 );
+            if ( m_Firing ) {
+                m_Deadline += period;
+                if ( !CatchUp( period ) ) return false;
+            } else {
+                m_Deadline = m_Sequencer->GetTime() + period;
+            }
+            m_Sequencer->ScheduleAt( m_TimerEntry, m_Deadline );
         }
         return false;
     }
 
     void Stop()
     {
-        if (m_Timer) m_Timer->cancel();
+        m_TimerEntry.Cancel();
         SeqEffect::Stop();
     }
 
 protected:
+    // service thread
+    void OnTimer()
+    {
+        boost::int64_t late = m_Sequencer->GetTime() - m_Deadline;
+        m_LateCount.fetch_add( 1, boost::memory_order_relaxed );
+        m_LateTotal.fetch_add( late, boost::memory_order_relaxed );
+        m_LateLast.store( late, boost::memory_order_relaxed );
+        if ( late > m_LateMax.load( boost::memory_order_relaxed ) ) m_LateMax.store( late, boost::memory_order_relaxed );
+        m_Sequencer->RecordTimerLateness( late );
+
+        m_Firing = true;
+        Notify();
+        m_Firing = false;
+    }
+
+    // applies the catch-up policy to m_Deadline, returns false if no repeat is left
+    bool CatchUp( boost::int64_t period )
+    {
+        boost::int64_t now = m_Sequencer->GetTime();
+        if ( m_CatchUp == CATCHUP_FIRE_ALL || m_Deadline > now || period <= 0 ) return true;
+
+        boost::int64_t missed = ( now - m_Deadline ) / period + 1;
+        // the latest missed period still fires, right away
+        if ( m_CatchUp == CATCHUP_COALESCE ) --missed;
+        if ( m_RepeatCounter > 0 ) {
+            // missed periods count as repeats, the sequence keeps its length
+            if ( m_RepeatCounter <= missed ) {
+                if ( m_CatchUp == CATCHUP_SKIP ) {
+                    m_Missed.fetch_add( m_RepeatCounter, boost::memory_order_relaxed );
+                    return false;
+                }
+                missed = m_RepeatCounter - 1;
+            }
+            m_RepeatCounter -= (int)missed;
+        }
+        m_Deadline += missed * period;
+        m_Missed.fetch_add( missed, boost::memory_order_relaxed );
+        return true;
+    }
 
     virtual void OnNotify()
     {
-        std::cout << "SeqTimedEffect::OnNotify: " << m_Message->asString() << " - #" << m_RepeatCounter << std::endl;
-        m_MessageQueue->Send( m_Message );
+        SEQ_TRACE( Tracer::TRACE_EFFECTS, Tracer::KIND_TIMED_NOTIFY, m_Message->GetKey(), m_RepeatCounter );
+        Send( m_Message );
     }
 
 };
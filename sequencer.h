@@ -10,9 +10,16 @@
 
 #include "sequence_effect.h"
 #include "listener.h"
+#include "async_listener.h"
+#include "effect_graph.h"
+#include "timing_wheel.h"
+#include "sequence_clock.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <vector>
 #include <list>
+#include <algorithm>
 
 #include <boost/thread/detail/thread.hpp>
 #include <boost/thread/mutex.hpp>
@@ -21,10 +28,19 @@
 #include <boost/function.hpp>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <boost/asio.hpp>
+#include <boost/asio/basic_waitable_timer.hpp>
+#include <boost/chrono.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
 class Sequencer;
 typedef boost::shared_ptr<Sequencer> SequencerPtr;
 
@@ -46,13 +62,23 @@ public:
     {
         SeqStates m_Body;
     public:
-        StateMessage( SeqStates state ) : m_Body(state) {}
+        // control messages, they overtake queued effect traffic
+        StateMessage( SeqStates state ) : Message( StateKey(state), Type() ), m_Body(state)
+        {
+            SetControl( true );
+        }
 
         virtual ~StateMessage() {}
 
-        virtual std::string asString() const
+        static MessageKey Type()
+        {
+            static const MessageKey type = MessageSymbols::Intern("StateMessage");
+            return type;
+        }
+
+        static const char* StateName( SeqStates state )
         {
-            switch (m_Body) {
+            switch (state) {
             case IDLE:      return "IDLE";
             case START:     return "START";
             case RUNNING:   return "RUNNING";
@@ -65,6 +91,49 @@ public:
             return "";
         }
 
+        // interned key of a state, same key as a StringMessage with the state's name
+        static MessageKey StateKey( SeqStates state )
+        {
+            static const MessageKey keys[] = {
+                MessageSymbols::Intern( StateName(IDLE) ),
+                MessageSymbols::Intern( StateName(START) ),
+                MessageSymbols::Intern( StateName(RUNNING) ),
+                MessageSymbols::Intern( StateName(TERMINATE) ),
+                MessageSymbols::Intern( StateName(STOPPED) ),
+                MessageSymbols::Intern( StateName(SUSPEND) ),
+                MessageSymbols::Intern( StateName(RESUME) )
+            };
+            return ( state >= IDLE && state <= RESUME ) ? keys[state] : 0;
+        }
+
+        static bool IsStateKey( MessageKey key )
+        {
+            for ( int state = IDLE; state <= RESUME; ++state ) {
+                if ( StateKey( (SeqStates)state ) == key ) return true;
+            }
+            return false;
+        }
+
+        // preallocated, shared instance per state
+        static const MessagePtr& Get( SeqStates state )
+        {
+            static const MessagePtr messages[] = {
+                MessagePtr( new StateMessage(IDLE) ),
+                MessagePtr( new StateMessage(START) ),
+                MessagePtr( new StateMessage(RUNNING) ),
+                MessagePtr( new StateMessage(TERMINATE) ),
+                MessagePtr( new StateMessage(STOPPED) ),
+                MessagePtr( new StateMessage(SUSPEND) ),
+                MessagePtr( new StateMessage(RESUME) )
+            };
+            return messages[ ( state >= IDLE && state <= RESUME ) ? state : IDLE ];
+        }
+
+        virtual std::string asString() const
+        {
+            return StateName( m_Body );
+        }
+
         SeqStates GetState() const { return m_Body; }
 
         bool operator==( SeqStates state )
@@ -73,59 +142,227 @@ public:
         }
     };
 
+    // one-shot wait for a message without registering a listener, see WaitEvent()
+    class EventWaiter
+    {
+    public:
+        virtual ~EventWaiter() {}
+
+        // message thread
+        virtual void OnWaitEvent( const MessagePtr& msg ) = 0;
+    };
+
+    /* Sees every message the message thread dispatches, see SetRecorder().
+     */
+    class Recorder
+    {
+    public:
+        virtual ~Recorder() {}
+
+        // message thread, time is GetTime(); source see SeqEffect::GetSourceId()
+        virtual void OnRecord( boost::int64_t time, boost::uint32_t source, const MessagePtr& msg ) = 0;
+    };
+    typedef boost::shared_ptr< Recorder > RecorderPtr;
+
     mutable boost::mutex                m_ListenerLock;
 
     typedef boost::asio::deadline_timer Timer;
     typedef boost::shared_ptr<Timer>    TimerPtr;
 
+    // max. number of messages the message thread takes off the queue per wakeup
+    enum { MaxBatchSize = 256 };
+
+    /* DISPATCH_THREAD: messages are dispatched on a message thread of their own.
+     * DISPATCH_REACTOR: there is no message thread, sends post a drain handler to the
+     * io_service and messages are dispatched on the service thread, between the timers.
+     * A timer's message reaches the listeners without a thread switch, but a slow listener
+     * delays the timers and a listener must not wait for the sequencer (e.g. WaitEvent()).
+     */
+    enum DispatchMode
+    {
+        DISPATCH_THREAD,
+        DISPATCH_REACTOR
+    };
+
+    typedef boost::asio::basic_waitable_timer< SeqRealTimeClock::Clock > WheelTimer;
+
+    // resolution of the timing wheel
+    enum { WheelTickUs = 100 };
+
+    /* Snapshot of the sequencer's instrumentation, see EnableMetrics(). Times are in
+     * nanoseconds.
+     */
+    struct Metrics
+    {
+        // Send() to dispatch on the message thread
+        HistogramSummary               m_DispatchLatency;
+        // SeqTimedEffect deadline to its timer callback
+        HistogramSummary               m_TimerLateness;
+        // messages queued whenever the message thread wakes up
+        HistogramSummary               m_QueueDepth;
+        boost::uint64_t                m_Dispatched;
+        MessageQueue::QueueStats       m_Queue;
+        // per effect, in Add() order
+        std::vector< boost::uint64_t > m_EffectNotifies;
+    };
+
 protected:
+    typedef std::vector< ListenerPtr > ListenerList;
+
+    /* Immutable dispatch index. Listeners with a single event key are looked up by key,
+     * everything else is a wildcard listener and sees every message (after the keyed ones).
+     * Writers copy, modify and publish a new index; the message thread only picks it up
+     * when m_ListenerVersion changed, so dispatch itself never waits on a lock.
+     */
+    struct ListenerIndex
+    {
+        typedef boost::unordered_map< MessageKey, ListenerList > KeyMap;
+
+        KeyMap       m_Keyed;
+        ListenerList m_Wildcard;
+    };
+    typedef boost::shared_ptr< const ListenerIndex > ListenerIndexPtr;
+
     SeqStates                           m_SeqState;
     MessageQueuePtr                     m_MessageQueue;
+    SeqClockPtr                         m_Clock;
+    // declared before the effects, they cancel their entries when destroyed
+    TimingWheel                         m_TimingWheel;
     std::vector< SeqEffectPtr >         m_SeqEvents;
 
+    // published index, read and written with boost::atomic_load/atomic_store
+    ListenerIndexPtr                    m_Listeners;
+    boost::atomic<unsigned>             m_ListenerVersion;
+    // message thread's copy of m_Listeners
+    ListenerIndexPtr                    m_ListenerSnapshot;
+    unsigned                            m_SnapshotVersion;
+    // workers for async listeners, created on first use
+    boost::scoped_ptr< ListenerPool >   m_ListenerPool;
+    // see EnableEffectGraph()
+    boost::scoped_ptr< EffectGraph >    m_EffectGraph;
+
+    typedef boost::unordered_map< MessageKey, std::vector< EventWaiter* > > WaiterMap;
+    boost::mutex                        m_WaiterLock;
+    WaiterMap                           m_Waiters;
+    // number of waiters in m_Waiters, dispatch skips the lock while there are none
+    boost::atomic<size_t>               m_WaiterCount;
+    // NotifyWaiters(): waiters taken from m_Waiters, and the one being called on m_NotifyThread
+    std::vector< EventWaiter* >         m_Notifying;
+    EventWaiter*                        m_NotifyCurrent;
+    boost::thread::id                   m_NotifyThread;
+    boost::condition_variable           m_NotifyDone;
+
+    // each written by one thread only, see MetricsCounter
+    boost::atomic<bool>                 m_MetricsEnabled;
+    LatencyHistogram                    m_DispatchLatency;  // message thread
+    LatencyHistogram                    m_QueueDepth;       // message thread
+    MetricsCounter                      m_Dispatched;       // message thread
+    LatencyHistogram                    m_TimerLateness;    // service thread
+    boost::scoped_ptr< MetricsDumper >  m_MetricsDumper;
+
+    // read and written with boost::atomic_load/atomic_store, m_Recording says if it is set
+    RecorderPtr                         m_Recorder;
+    boost::atomic<bool>                 m_Recording;
+
     bool                                m_TerminateThread;
+    DispatchMode                        m_DispatchMode;
+    // DISPATCH_REACTOR: a drain handler is posted and has not started yet
+    boost::atomic<bool>                 m_DrainScheduled;
+    // DISPATCH_REACTOR: TERMINATE was dispatched, service thread only
+    bool                                m_Terminated;
+    // message thread: source of the message being dispatched, see SeqEffect::GetSourceId()
+    boost::uint32_t                     m_DispatchSource;
+    MessageQueue::EntryList             m_DrainBatch;
     boost::shared_ptr< boost::thread >  m_MsgThread;
 
     std::vector< MessagePtr >           m_ListenerMask;
 
-    typedef std::list< ListenerPtr > ListenerList;
-    ListenerList                        m_ListerList;
-
     boost::asio::io_service             m_IOService;
     boost::asio::io_service::work       m_IOServiceWork;
 
+    // drives m_TimingWheel on the service thread
+    WheelTimer                          m_WheelTimer;
+    // simulated clock: travels through the message queue, see OnClockMarker()
+    MessagePtr                          m_ClockMarker;
+    boost::atomic<bool>                 m_ClockMarkerSent;
+
     boost::shared_ptr< boost::thread >  m_ServiceThread;
 public:
-    Sequencer( const MessageQueuePtr& msgQueue )
+    Sequencer( const MessageQueuePtr& msgQueue, const SeqClockPtr& clock = SeqClockPtr(), DispatchMode mode = DISPATCH_THREAD )
         : m_SeqState(IDLE)
         , m_MessageQueue( msgQueue )
-        , m_MsgThread( new boost::thread( boost::bind( &Sequencer::MessageThread, this )))
+        , m_Clock( clock ? clock : SeqClockPtr( new SeqRealTimeClock ) )
+        , m_Listeners( new ListenerIndex )
+        , m_ListenerVersion(0)
+        , m_ListenerSnapshot( m_Listeners )
+        , m_SnapshotVersion(0)
+        , m_WaiterCount(0)
+        , m_NotifyCurrent(NULL)
+        , m_MetricsEnabled(false)
+        , m_Recording(false)
+        , m_DispatchMode(mode)
+        , m_DrainScheduled(false)
+        , m_Terminated(false)
+        , m_DispatchSource(0)
+        , m_MsgThread( mode == DISPATCH_THREAD ? new boost::thread( boost::bind( &Sequencer::MessageThread, this ) ) : new boost::thread )
     	, m_IOServiceWork(m_IOService)
+        , m_WheelTimer(m_IOService)
+        , m_ClockMarker( new Message( MessageSymbols::Intern("SequencerClock"), Message::Type() ) )
+        , m_ClockMarkerSent(false)
     	, m_ServiceThread( new boost::thread( boost::bind( &boost::asio::io_service::run, &m_IOService )))
     {
+        if ( mode == DISPATCH_REACTOR ) InitReactor();
     }
 
-    Sequencer( )
+    explicit Sequencer( const SeqClockPtr& clock = SeqClockPtr(), DispatchMode mode = DISPATCH_THREAD )
         : m_SeqState(IDLE)
         , m_MessageQueue( new MessageQueue() )
-        , m_MsgThread( new boost::thread( boost::bind( &Sequencer::MessageThread, this )))
+        , m_Clock( clock ? clock : SeqClockPtr( new SeqRealTimeClock ) )
+        , m_Listeners( new ListenerIndex )
+        , m_ListenerVersion(0)
+        , m_ListenerSnapshot( m_Listeners )
+        , m_SnapshotVersion(0)
+        , m_WaiterCount(0)
+        , m_NotifyCurrent(NULL)
+        , m_MetricsEnabled(false)
+        , m_Recording(false)
+        , m_DispatchMode(mode)
+        , m_DrainScheduled(false)
+        , m_Terminated(false)
+        , m_DispatchSource(0)
+        , m_MsgThread( mode == DISPATCH_THREAD ? new boost::thread( boost::bind( &Sequencer::MessageThread, this ) ) : new boost::thread )
 		, m_IOServiceWork(m_IOService)
+        , m_WheelTimer(m_IOService)
+        , m_ClockMarker( new Message( MessageSymbols::Intern("SequencerClock"), Message::Type() ) )
+        , m_ClockMarkerSent(false)
     	, m_ServiceThread( new boost::thread( boost::bind( &boost::asio::io_service::run, &m_IOService )))
     {
+        if ( mode == DISPATCH_REACTOR ) InitReactor();
     }
 
     virtual ~Sequencer()
     {
+        m_MetricsDumper.reset();
         Stop();
         m_IOService.stop();
-        m_ServiceThread->join();
+        if ( m_ServiceThread->joinable() ) m_ServiceThread->join();
+
+        // a Send undoes CancelWait(), so quiet our other senders first: graph tasks and
+        // the listener pool (after the listeners are gone, nothing feeds it any more)
+        if ( m_EffectGraph ) m_EffectGraph->Deactivate();
+        {
+            boost::mutex::scoped_lock lock(m_ListenerLock);
+            PublishListeners( ListenerIndexPtr( new ListenerIndex ) );
+        }
+        // deliver what is left in the mailboxes
+        if ( m_ListenerPool ) m_ListenerPool->Stop();
 
         // send terminate to thread
         m_MessageQueue->CancelWait();
-        m_MsgThread->join();
-
-        boost::mutex::scoped_lock lock(m_ListenerLock);
-        m_ListerList.clear();
+        if ( m_MsgThread->joinable() ) m_MsgThread->join();
+        if ( m_DispatchMode == DISPATCH_REACTOR ) m_MessageQueue->SetDispatcher( boost::function< void () >() );
+        m_ListenerSnapshot.reset();
+        m_EffectGraph.reset();
     }
 
     TimerPtr CreateTimer()
@@ -133,18 +370,219 @@ public:
     	return TimerPtr(new Timer(m_IOService));
     }
 
-    ListenerPtr RegisterListener( const ListenerPtr& listener )
+    // pins the message and the service thread to a core, returns false if not supported
+    bool SetAffinity( unsigned core )
+    {
+#ifdef __linux__
+        cpu_set_t cpus;
+        CPU_ZERO( &cpus );
+        CPU_SET( core, &cpus );
+        if ( m_MsgThread->joinable() && pthread_setaffinity_np( m_MsgThread->native_handle(), sizeof(cpus), &cpus ) != 0 ) return false;
+        return pthread_setaffinity_np( m_ServiceThread->native_handle(), sizeof(cpus), &cpus ) == 0;
+#else
+        return false;
+#endif
+    }
+
+    // microseconds on the sequencer's clock
+    boost::int64_t GetTime() const
+    {
+        return m_Clock->Now();
+    }
+
+    const SeqClockPtr& GetClock() const
+    {
+        return m_Clock;
+    }
+
+    /* Schedules a timing wheel entry to fire ms milliseconds from now on the service thread.
+     * Much cheaper than an asio timer per effect; cancel with entry.Cancel().
+     */
+    void Schedule( TimingWheel::Entry& entry, double ms )
+    {
+        ScheduleAt( entry, GetTime() + (boost::int64_t)( ms * 1000.0 + 0.5 ) );
+    }
+
+    // same, at an absolute time in GetTime() microseconds
+    void ScheduleAt( TimingWheel::Entry& entry, boost::int64_t time )
+    {
+        boost::int64_t now = GetTime();
+        TimingWheel::Tick expiry = time > 0 ? ( time + WheelTickUs - 1 ) / WheelTickUs : 0;
+        if ( m_TimingWheel.Schedule( entry, expiry, now / WheelTickUs ) ) {
+            m_IOService.post( boost::bind( &Sequencer::OnWheelTick, this, boost::system::error_code() ) );
+        }
+    }
+
+    // off by default; stamps every Send() and records dispatch latency, queue depth and timer lateness
+    void EnableMetrics( bool enable = true )
+    {
+        m_MetricsEnabled.store( enable, boost::memory_order_relaxed );
+        m_MessageQueue->SetStamping( enable );
+    }
+
+    bool IsMetricsEnabled() const
+    {
+        return m_MetricsEnabled.load( boost::memory_order_relaxed );
+    }
+
+    Metrics GetMetrics() const
+    {
+        Metrics metrics;
+        metrics.m_DispatchLatency = m_DispatchLatency.Summarize();
+        metrics.m_TimerLateness   = m_TimerLateness.Summarize();
+        metrics.m_QueueDepth      = m_QueueDepth.Summarize();
+        metrics.m_Dispatched      = m_Dispatched.Get();
+        metrics.m_Queue           = m_MessageQueue->GetStats();
+        for ( size_t i = 0; i < m_SeqEvents.size(); ++i ) {
+            metrics.m_EffectNotifies.push_back( m_SeqEvents[i] ? m_SeqEvents[i]->GetNotifyCount() : 0 );
+        }
+        return metrics;
+    }
+
+    // GetMetrics() in Prometheus text format
+    std::string GetMetricsText() const
+    {
+        Metrics metrics = GetMetrics();
+        PrometheusWriter out;
+        out.Summary( "sequencer_dispatch_latency_seconds", "Time from Send() to dispatch.", metrics.m_DispatchLatency, 1e-9 );
+        out.Summary( "sequencer_timer_lateness_seconds", "Time from a timed effect's deadline to its timer callback.", metrics.m_TimerLateness, 1e-9 );
+        out.Summary( "sequencer_queue_depth", "Messages queued when the message thread wakes up.", metrics.m_QueueDepth );
+        out.Family( "sequencer_messages_dispatched_total", "counter", "Messages dispatched." );
+        out.Sample( "sequencer_messages_dispatched_total", (double)metrics.m_Dispatched );
+        out.Family( "sequencer_queue_dropped_total", "counter", "Messages dropped by the queue's overflow policy." );
+        out.Sample( "sequencer_queue_dropped_total", (double)metrics.m_Queue.m_Dropped );
+        out.Family( "sequencer_queue_coalesced_total", "counter", "Messages replaced by a newer one of the same key." );
+        out.Sample( "sequencer_queue_coalesced_total", (double)metrics.m_Queue.m_Coalesced );
+        out.Family( "sequencer_queue_blocked_total", "counter", "Sends which waited for room in the queue." );
+        out.Sample( "sequencer_queue_blocked_total", (double)metrics.m_Queue.m_Blocked );
+        out.Family( "sequencer_effect_notify_total", "counter", "Times an effect fired." );
+        for ( size_t i = 0; i < metrics.m_EffectNotifies.size(); ++i ) {
+            std::ostringstream label;
+            label << "effect=\"" << i << '"';
+            out.Sample( "sequencer_effect_notify_total", (double)metrics.m_EffectNotifies[i], label.str() );
+        }
+        return out.Str();
+    }
+
+    // enables metrics and writes GetMetricsText() to path every intervalMs, on a thread of its own
+    void StartMetricsDump( const std::string& path, unsigned intervalMs = 1000 )
+    {
+        EnableMetrics();
+        m_MetricsDumper.reset();
+        m_MetricsDumper.reset( new MetricsDumper( boost::bind( &Sequencer::GetMetricsText, this ), path, intervalMs ) );
+    }
+
+    void StopMetricsDump()
+    {
+        m_MetricsDumper.reset();
+    }
+
+    // service thread, lateness in microseconds
+    void RecordTimerLateness( boost::int64_t late )
+    {
+        if ( m_MetricsEnabled.load( boost::memory_order_relaxed ) ) {
+            m_TimerLateness.Record( (boost::uint64_t)std::max( late, (boost::int64_t)0 ) * 1000 );
+        }
+    }
+
+    // hands every dispatched message to recorder, e.g. a MessageLogWriter; NULL stops recording
+    void SetRecorder( const RecorderPtr& recorder )
+    {
+        if ( !recorder ) m_Recording.store( false, boost::memory_order_release );
+        boost::atomic_store( &m_Recorder, recorder );
+        if ( recorder ) m_Recording.store( true, boost::memory_order_release );
+    }
+
+    // safe to call from within Listener::OnEvent, takes effect with the next message
+    virtual ListenerPtr RegisterListener( const ListenerPtr& listener )
     {
         boost::mutex::scoped_lock lock(m_ListenerLock);
 
-        m_ListerList.push_back( listener );
+        boost::shared_ptr< ListenerIndex > index( new ListenerIndex( *boost::atomic_load( &m_Listeners ) ) );
+        MessageKey key;
+        if ( listener->GetEventKey( key ) ) {
+            index->m_Keyed[key].push_back( listener );
+        } else {
+            index->m_Wildcard.push_back( listener );
+        }
+        PublishListeners( index );
         return listener;
     }
 
-    void UnregisterListener( const ListenerPtr& listener )
+    /* Delivers to listener from a bounded mailbox on the listener pool instead of on the
+     * message thread, a slow listener then can't hold up any other. Returns the registered
+     * AsyncListener, pass that to UnregisterListener().
+     */
+    ListenerPtr RegisterAsyncListener( const ListenerPtr& listener, size_t capacity = AsyncListener::DefaultCapacity,
+                                       MessageQueue::OverflowPolicy policy = MessageQueue::OVERFLOW_DROP_OLDEST )
+    {
+        return RegisterListener( ListenerPtr( new AsyncListener( listener, GetListenerPool(), capacity, policy ) ) );
+    }
+
+    // shared by all async listeners of this sequencer, one thread per core
+    ListenerPool& GetListenerPool()
+    {
+        boost::mutex::scoped_lock lock(m_ListenerLock);
+        if ( !m_ListenerPool ) m_ListenerPool.reset( new ListenerPool );
+        return *m_ListenerPool;
+    }
+
+    /* Fires event triggered effects through an EffectGraph on a pool of threads (0: one
+     * per core) instead of one step at a time through the message thread. Call it before
+     * Start(), the graph is rebuilt from the effects on every start. Effects in the graph
+     * run concurrently with each other and with the listeners.
+     */
+    void EnableEffectGraph( size_t threads = 0 )
+    {
+        if ( !m_EffectGraph ) m_EffectGraph.reset( new EffectGraph( threads ) );
+    }
+
+    // NULL unless enabled
+    const EffectGraph* GetEffectGraph() const
+    {
+        return m_EffectGraph.get();
+    }
+
+    virtual void UnregisterListener( const ListenerPtr& listener )
     {
         boost::mutex::scoped_lock lock(m_ListenerLock);
-        m_ListerList.remove_if( boost::bind( &Sequencer::IsListener, this, _1, listener )  );
+
+        boost::shared_ptr< ListenerIndex > index( new ListenerIndex( *boost::atomic_load( &m_Listeners ) ) );
+        MessageKey key;
+        if ( listener->GetEventKey( key ) ) {
+            ListenerIndex::KeyMap::iterator it = index->m_Keyed.find( key );
+            if ( it != index->m_Keyed.end() ) {
+                RemoveListener( it->second, listener );
+                if ( it->second.empty() ) index->m_Keyed.erase( it );
+            }
+        } else {
+            RemoveListener( index->m_Wildcard, listener );
+        }
+        PublishListeners( index );
+    }
+
+    // waiter->OnWaitEvent() is called once, for the next message with key
+    virtual void WaitEvent( MessageKey key, EventWaiter* waiter )
+    {
+        boost::mutex::scoped_lock lock(m_WaiterLock);
+        m_Waiters[key].push_back( waiter );
+        m_WaiterCount.fetch_add( 1, boost::memory_order_release );
+    }
+
+    // waiter is not called once this returns, a call in progress on another thread finishes first
+    virtual void CancelEventWait( MessageKey key, EventWaiter* waiter )
+    {
+        boost::mutex::scoped_lock lock(m_WaiterLock);
+        std::replace( m_Notifying.begin(), m_Notifying.end(), waiter, (EventWaiter*)NULL );
+        while ( m_NotifyCurrent == waiter && m_NotifyThread != boost::this_thread::get_id() ) m_NotifyDone.wait( lock );
+        WaiterMap::iterator it = m_Waiters.find( key );
+        if ( it == m_Waiters.end() ) return;
+        std::vector< EventWaiter* >& waiters = it->second;
+        std::vector< EventWaiter* >::iterator w = std::find( waiters.begin(), waiters.end(), waiter );
+        if ( w == waiters.end() ) return;
+        waiters.erase( w );
+        m_WaiterCount.fetch_sub( 1, boost::memory_order_relaxed );
+        if ( waiters.empty() ) m_Waiters.erase( it );
     }
 
     void SetMessageQueue( const MessageQueuePtr& msgQueue )
@@ -157,8 +595,15 @@ public:
         return m_MessageQueue;
     }
 
+    // the service thread's reactor, it also drives the timing wheel
+    boost::asio::io_service& GetIOService()
+    {
+        return m_IOService;
+    }
+
     SeqEffectPtr Add( SeqEffectPtr t )
     {
+        if ( t ) t->SetSourceId( (boost::uint32_t)m_SeqEvents.size() + 1 );
         if ( t && t->GetMessageQueue() == NULL ) {
             t->SetMessageQueue( m_MessageQueue );
             t->Init( this );
@@ -179,14 +624,14 @@ public:
     void Start()
     {
         if ( m_SeqState != START ) {
-            m_MessageQueue->Send( MessagePtr( new StateMessage(START) ));
+            m_MessageQueue->Send( StateMessage::Get(START) );
         }
     }
 
     void Stop()
     {
         if ( m_SeqState!= STOPPED ) {
-            m_MessageQueue->Send( MessagePtr( new StateMessage(STOPPED) ));
+            m_MessageQueue->Send( StateMessage::Get(STOPPED) );
         }
     }
 
@@ -195,15 +640,103 @@ protected:
         return a.get() == b.get();
     }
 
+    void RemoveListener( ListenerList& list, const ListenerPtr& listener )
+    {
+        list.erase( std::remove_if( list.begin(), list.end(), boost::bind( &Sequencer::IsListener, this, _1, listener ) ), list.end() );
+    }
+
+    // m_ListenerLock must be held
+    void PublishListeners( const ListenerIndexPtr& index )
+    {
+        boost::atomic_store( &m_Listeners, index );
+        m_ListenerVersion.fetch_add( 1, boost::memory_order_release );
+    }
+
+    // message thread only
+    const ListenerIndexPtr& GetListenerSnapshot()
+    {
+        unsigned version = m_ListenerVersion.load( boost::memory_order_acquire );
+        if ( version != m_SnapshotVersion ) {
+            m_ListenerSnapshot = boost::atomic_load( &m_Listeners );
+            m_SnapshotVersion  = version;
+        }
+        return m_ListenerSnapshot;
+    }
+
+    // service thread
+    void OnWheelTick( const boost::system::error_code& error )
+    {
+        if ( error ) return; // re-armed or shut down
+
+        TimingWheel::Tick next;
+        if ( m_TimingWheel.Advance( GetTime() / WheelTickUs, next ) ) {
+            if ( m_Clock->IsSimulated() ) {
+                // advance once everything due now went through the message queue
+                if ( !m_ClockMarkerSent.exchange( true ) ) m_MessageQueue->Send( m_ClockMarker );
+                return;
+            }
+            boost::int64_t wait = (boost::int64_t)next * WheelTickUs - GetTime();
+            m_WheelTimer.expires_at( SeqRealTimeClock::Clock::now() + boost::chrono::microseconds( std::max( wait, (boost::int64_t)0 ) ) );
+            m_WheelTimer.async_wait( boost::bind( &Sequencer::OnWheelTick, this, boost::asio::placeholders::error ) );
+        }
+    }
+
+    // message thread, the marker made it through the queue
+    void OnClockMarker()
+    {
+        // graph effects still running belong to the current time, the graph resends us when done
+        if ( m_EffectGraph && !m_EffectGraph->CallWhenIdle( boost::bind( &Sequencer::ResendClockMarker, this ) ) ) return;
+        if ( !m_MessageQueue->IsEmpty() ) {
+            // more work came in meanwhile, go round once more
+            ResendClockMarker();
+            return;
+        }
+        m_ClockMarkerSent.store( false );
+        m_IOService.post( boost::bind( &Sequencer::OnClockAdvance, this ) );
+    }
+
+    void ResendClockMarker()
+    {
+        m_MessageQueue->Send( m_ClockMarker );
+    }
+
+    // service thread, simulated clock only: jumps to the next tick that fires anything
+    void OnClockAdvance()
+    {
+        // handlers posted ahead of us (e.g. a coroutine restarting) may have sent meanwhile
+        if ( !m_MessageQueue->IsEmpty() ) {
+            if ( !m_ClockMarkerSent.exchange( true ) ) m_MessageQueue->Send( m_ClockMarker );
+            return;
+        }
+        TimingWheel::Tick next;
+        boost::uint64_t fired = m_TimingWheel.GetFiredCount();
+        bool pending = !m_TimingWheel.IsEmpty();
+        while ( pending && fired == m_TimingWheel.GetFiredCount() ) {
+            next = m_TimingWheel.NextTick();
+            m_Clock->AdvanceTo( (boost::int64_t)next * WheelTickUs );
+            pending = m_TimingWheel.Advance( next, next );
+        }
+        if ( pending && !m_ClockMarkerSent.exchange( true ) ) m_MessageQueue->Send( m_ClockMarker );
+    }
+
     virtual void OnStart()
     {
+        if ( m_EffectGraph ) m_EffectGraph->Build( m_SeqEvents );
         std::for_each( m_SeqEvents.begin(), m_SeqEvents.end(), boost::bind( &SeqEffect::Start, _1 ) );
     }
 
-    virtual void OnStop()
+    void StopEffects()
     {
+        // drops all pending timers in one go, effects may still clean up in Stop()
+        m_TimingWheel.CancelAll();
+        if ( m_EffectGraph ) m_EffectGraph->Deactivate();
         std::for_each( m_SeqEvents.begin(), m_SeqEvents.end(), boost::bind( &SeqEffect::Stop, _1 ) );
-        OnProcessEvent( MessagePtr( new StateMessage(STOPPED) ) );
+    }
+
+    virtual void OnStop()
+    {
+        StopEffects();
+        OnProcessEvent( StateMessage::Get(STOPPED) );
     }
 
     virtual void OnSuspend()
@@ -218,82 +751,186 @@ protected:
 
     virtual void OnProcessEvent( const MessagePtr& evt )
     {
-        boost::mutex::scoped_lock lock(m_ListenerLock);
-        if ( m_ListerList.size() > 0 ) {
-            MessagePtr stopEvt( new StateMessage(m_SeqState) );
-            std::for_each( m_ListerList.begin(), m_ListerList.end(), boost::bind( &Listener::OnEvent, _1, evt ));
+        // keep the snapshot alive even if a listener (un)registers from OnEvent
+        ListenerIndexPtr listeners = GetListenerSnapshot();
+        if ( !listeners ) return;
+
+        ListenerIndex::KeyMap::const_iterator it = listeners->m_Keyed.find( evt->GetKey() );
+        if ( it != listeners->m_Keyed.end() ) {
+            std::for_each( it->second.begin(), it->second.end(), boost::bind( &Listener::OnEvent, _1, evt ));
         }
+        std::for_each( listeners->m_Wildcard.begin(), listeners->m_Wildcard.end(), boost::bind( &Listener::OnEvent, _1, evt ));
+
+        if ( m_WaiterCount.load( boost::memory_order_acquire ) ) NotifyWaiters( evt );
+        if ( m_EffectGraph ) m_EffectGraph->Dispatch( evt, m_DispatchSource );
     }
 
-    virtual void MessageThread()
+    void NotifyWaiters( const MessagePtr& evt )
     {
-        bool terminate(false);
+        boost::mutex::scoped_lock lock(m_WaiterLock);
+        WaiterMap::iterator it = m_Waiters.find( evt->GetKey() );
+        if ( it == m_Waiters.end() ) return;
+        // waiters waiting again from OnWaitEvent get the next message
+        m_Notifying.swap( it->second );
+        m_Waiters.erase( it );
+        m_WaiterCount.fetch_sub( m_Notifying.size(), boost::memory_order_relaxed );
+        m_NotifyThread = boost::this_thread::get_id();
+        // called without the lock; CancelEventWait() clears a waiter not called yet, or waits for it
+        for ( size_t i = 0; i < m_Notifying.size(); ++i ) {
+            EventWaiter* waiter = m_Notifying[i];
+            if ( !waiter ) continue;
+            m_NotifyCurrent = waiter;
+            lock.unlock();
+            waiter->OnWaitEvent( evt );
+            lock.lock();
+            m_NotifyCurrent = NULL;
+            m_NotifyDone.notify_all();
+        }
+        m_Notifying.clear();
+    }
 
-        do {
-            MessagePtr evt = m_MessageQueue->Wait();
-            if (evt == NULL) break; // got canceled
-            while ( !terminate && evt ) {
-                std::cout << "Sequencer::Received: " << evt->asString() << std::endl;
-                StateMessage* sm = evt ? evt->as<StateMessage*>() : NULL;
-                if ( sm ) {
-                    switch (sm->GetState()) {
-                    case TERMINATE:
-                        terminate = true;
-                        m_SeqState = STOPPED;
-                        break;
-                    case START:
-                        m_SeqState = START;
-                        break;
-                        // IDLE == Suspend
-                    case SUSPEND:
-                        if ( m_SeqState == RUNNING ) {
-                            m_SeqState = SUSPEND;
-                        }
-                        break;
-                        // RUNNING == RESUME
-                    case RESUME:
-                        if ( m_SeqState == IDLE ) {
-                            m_SeqState = RESUME;
-                        }
-                        break;
-                    case STOPPED:
-                        m_SeqState = STOPPED;
-                        break;
-                    default:
-                        break;
-                    }
+    // returns true if the message thread should terminate
+    virtual bool ProcessMessage( const MessagePtr& evt )
+    {
+        bool terminate(false);
+        SEQ_TRACE( Tracer::TRACE_MESSAGES, Tracer::KIND_RECEIVED, evt->GetKey(), m_SeqState );
+        StateMessage* sm = evt ? evt->Cast<StateMessage>() : NULL;
+        if ( sm ) {
+            SEQ_TRACE( Tracer::TRACE_STATE, Tracer::KIND_STATE, evt->GetKey(), sm->GetState() );
+            switch (sm->GetState()) {
+            case TERMINATE:
+                terminate = true;
+                m_SeqState = STOPPED;
+                break;
+            case START:
+                m_SeqState = START;
+                break;
+                // IDLE == Suspend
+            case SUSPEND:
+                if ( m_SeqState == RUNNING ) {
+                    m_SeqState = SUSPEND;
                 }
-                switch ( m_SeqState ) {
-                case START:
-                    OnStart();
-                    m_SeqState = RUNNING;
-                    break;
-                case SUSPEND:
-                    OnSuspend();
-                    m_SeqState = IDLE;
-                    break;
-                    // RUNNING == RESUME
-                case RESUME:
-                    OnResume();
-                    m_SeqState = RUNNING;
-                    break;
-                case RUNNING:
-                    OnProcessEvent(evt);
-                    break;
-                case STOPPED:
-                    OnStop();
-                    m_SeqState = IDLE;
-                    break;
-                default:
-                    break;
+                break;
+                // RUNNING == RESUME
+            case RESUME:
+                if ( m_SeqState == IDLE ) {
+                    m_SeqState = RESUME;
                 }
+                break;
+            case STOPPED:
+                m_SeqState = STOPPED;
+                break;
+            default:
+                break;
+            }
+        }
+        switch ( m_SeqState ) {
+        case START:
+            OnStart();
+            m_SeqState = RUNNING;
+            break;
+        case SUSPEND:
+            OnSuspend();
+            m_SeqState = IDLE;
+            break;
+            // RUNNING == RESUME
+        case RESUME:
+            OnResume();
+            m_SeqState = RUNNING;
+            break;
+        case RUNNING:
+            OnProcessEvent(evt);
+            break;
+        case STOPPED:
+            OnStop();
+            m_SeqState = IDLE;
+            break;
+        default:
+            break;
+        }
+        return terminate;
+    }
+
+    // message thread
+    void RecordDispatch( const MessageQueue::Entry& entry )
+    {
+        if ( entry.m_Stamp ) m_DispatchLatency.Record( (boost::uint32_t)( MetricsClock::Stamp() - entry.m_Stamp ) );
+        m_Dispatched.Add();
+    }
 
-                if (!terminate) evt = m_MessageQueue->Poll( );
+    // dispatches one batch taken off the queue and clears it, returns true on TERMINATE
+    bool DispatchBatch( MessageQueue::EntryList& batch, size_t queued )
+    {
+        bool terminate(false);
+        bool metrics = m_MetricsEnabled.load( boost::memory_order_relaxed );
+        // the recorder in use stays alive for the whole batch
+        RecorderPtr recorder;
+        if ( m_Recording.load( boost::memory_order_acquire ) ) recorder = boost::atomic_load( &m_Recorder );
+        if ( metrics ) m_QueueDepth.Record( queued );
+        bool marker(false);
+        for ( MessageQueue::EntryList::iterator it = batch.begin(); !terminate && it != batch.end(); ++it ) {
+            if ( it->m_Value == m_ClockMarker ) {
+                marker = true;
+                continue;
             }
+            if ( metrics ) RecordDispatch( *it );
+            if ( recorder ) recorder->OnRecord( GetTime(), it->m_Source, it->m_Value );
+            m_DispatchSource = it->m_Source;
+            terminate = ProcessMessage( it->m_Value );
+        }
+        batch.clear();
+        if ( marker && !terminate ) OnClockMarker();
+        return terminate;
+    }
+
+    virtual void MessageThread()
+    {
+        bool terminate(false);
+        MessageQueue::EntryList batch;
+        batch.reserve( MaxBatchSize );
+
+        do {
+            MessageQueue::Entry entry;
+            if ( !m_MessageQueue->Wait( entry ) ) break; // got canceled
+            size_t queued = m_MetricsEnabled.load( boost::memory_order_relaxed ) ? m_MessageQueue->Size() + 1 : 0;
+            // take whatever else is pending with the same wakeup
+            batch.push_back( entry );
+            m_MessageQueue->PollBatch( batch, MaxBatchSize - 1 );
+            terminate = DispatchBatch( batch, queued );
         } while (!terminate);
 
     }
 
+    // DISPATCH_REACTOR: called by the constructor, before anything is sent
+    void InitReactor()
+    {
+        m_DrainBatch.reserve( MaxBatchSize );
+        m_MessageQueue->SetDispatcher( boost::bind( &Sequencer::ScheduleDrain, this ) );
+        m_IOService.post( boost::bind( &MessageQueue::SetConsumer, m_MessageQueue.get() ) );
+    }
+
+    // any thread, after a send; posts at most one drain handler at a time
+    void ScheduleDrain()
+    {
+        if ( m_DrainScheduled.load( boost::memory_order_relaxed ) || m_DrainScheduled.exchange( true ) ) return;
+        m_IOService.post( boost::bind( &Sequencer::OnDrain, this ) );
+    }
+
+    // DISPATCH_REACTOR: the message thread's loop body as a handler on the service thread
+    void OnDrain()
+    {
+        m_DrainScheduled.store( false, boost::memory_order_relaxed );
+        // pairs with the fence in the queue's Notify(): a send we miss schedules again
+        boost::atomic_thread_fence( boost::memory_order_seq_cst );
+        if ( m_Terminated ) return;
+        size_t queued = m_MetricsEnabled.load( boost::memory_order_relaxed ) ? m_MessageQueue->Size() : 0;
+        m_MessageQueue->PollBatch( m_DrainBatch, MaxBatchSize );
+        if ( m_DrainBatch.empty() ) return;
+        m_Terminated = DispatchBatch( m_DrainBatch, queued );
+        // a full batch: more may be queued, let the timers in before the rest
+        if ( !m_Terminated && !m_MessageQueue->IsEmpty() ) ScheduleDrain();
+    }
+
 };
 
 
@@ -0,0 +1,303 @@
+#ifndef __SHARDED_SEQUENCER_H__
+#define __SHARDED_SEQUENCER_H__
+
+#include "sequencer.h"
+
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+/* Sequencer split into N shards, each a full Sequencer with its own io_service, timing
+ * wheel and message thread, optionally pinned to a core.
+ *
+ * Every message key has a home shard. Messages are dispatched on their home shard only,
+ * a shard forwards anything else it receives, so messages of one key keep their order.
+ * Effects are placed on the home shard of their trigger key (or of their output key) which
+ * saves the forwarding hop in the common case. Keyed listeners live on their key's shard,
+ * wildcard listeners and listeners of sequencer states are registered with every shard.
+ * A wildcard listener is therefore called from several shard threads at once and has to
+ * be thread safe; so does a state listener.
+ *
+ * State changes are broadcast to the shards still running. STOPPED is announced once, by
+ * the last of them that stopped its effects.
+ */
+class ShardedSequencer
+{
+public:
+    typedef Sequencer::SeqStates    SeqStates;
+    typedef Sequencer::StateMessage StateMessage;
+
+protected:
+    // a state change sent to all shards
+    class ControlMessage : public Message
+    {
+        MessagePtr            m_State;
+        boost::atomic<size_t> m_Remaining;
+    public:
+        ControlMessage( const MessagePtr& state, size_t shards )
+            : Message( state->GetKey(), Type() )
+            , m_State(state)
+            , m_Remaining(shards)
+        {
+            SetControl( true );
+        }
+
+        static MessageKey Type()
+        {
+            static const MessageKey type = MessageSymbols::Intern("ShardControl");
+            return type;
+        }
+
+        const MessagePtr& GetState() const { return m_State; }
+
+        bool IsStop() const
+        {
+            const StateMessage* sm = m_State->Cast<StateMessage>();
+            return sm && ( sm->GetState() == Sequencer::STOPPED || sm->GetState() == Sequencer::TERMINATE );
+        }
+
+        // true for the last shard done with it
+        bool Done()
+        {
+            return m_Remaining.fetch_sub( 1, boost::memory_order_acq_rel ) == 1;
+        }
+    };
+
+    class Shard : public Sequencer
+    {
+        ShardedSequencer* m_Owner;
+        // the message thread still takes broadcasts, under the owner's m_BroadcastLock
+        bool              m_Running;
+
+        void Done( ControlMessage* control )
+        {
+            if ( control->IsStop() && control->Done() ) {
+                OnProcessEvent( StateMessage::Get(STOPPED) );
+            }
+        }
+
+        // message thread, about to exit: broadcasts already queued still count us down
+        void Retire()
+        {
+            {
+                boost::mutex::scoped_lock lock( m_Owner->m_BroadcastLock );
+                m_Running = false;
+            }
+            while ( MessagePtr msg = m_MessageQueue->Poll() ) {
+                ControlMessage* control = msg->Cast<ControlMessage>();
+                if ( control ) Done( control );
+            }
+        }
+
+    public:
+        Shard( ShardedSequencer* owner ) : m_Owner(owner), m_Running(true) {}
+
+        virtual ~Shard()
+        {
+            Shutdown();
+        }
+
+        // listeners registered by effects (see SeqEventEffect::Init) go wherever their key lives
+        virtual ListenerPtr RegisterListener( const ListenerPtr& listener )
+        {
+            return m_Owner->RegisterListener( listener );
+        }
+
+        virtual void UnregisterListener( const ListenerPtr& listener )
+        {
+            m_Owner->UnregisterListener( listener );
+        }
+
+        // messages of key are only dispatched on its home shard
+        virtual void WaitEvent( MessageKey key, EventWaiter* waiter )
+        {
+            m_Owner->GetHome( key )->Sequencer::WaitEvent( key, waiter );
+        }
+
+        virtual void CancelEventWait( MessageKey key, EventWaiter* waiter )
+        {
+            m_Owner->GetHome( key )->Sequencer::CancelEventWait( key, waiter );
+        }
+
+        ListenerPtr RegisterLocal( const ListenerPtr& listener )
+        {
+            return Sequencer::RegisterListener( listener );
+        }
+
+        void UnregisterLocal( const ListenerPtr& listener )
+        {
+            Sequencer::UnregisterListener( listener );
+        }
+
+        // waits for the message thread to exit, needs a TERMINATE in the queue
+        // under the owner's m_BroadcastLock
+        bool IsRunning() const
+        {
+            return m_Running;
+        }
+
+        void Shutdown()
+        {
+            m_IOService.stop();
+            if ( m_ServiceThread->joinable() ) m_ServiceThread->join();
+            if ( m_MsgThread->joinable() ) m_MsgThread->join();
+        }
+
+    protected:
+        // the owner announces STOPPED once all shards are done
+        virtual void OnStop()
+        {
+            StopEffects();
+        }
+
+        virtual bool ProcessMessage( const MessagePtr& evt )
+        {
+            ControlMessage* control = evt->Cast<ControlMessage>();
+            if ( control ) {
+                bool terminate = Sequencer::ProcessMessage( control->GetState() );
+                Done( control );
+                if ( terminate ) Retire();
+                return terminate;
+            }
+            // sent by an effect, e.g. TERMINATE
+            if ( evt->Cast<StateMessage>() ) {
+                m_Owner->Broadcast( evt );
+                return false;
+            }
+            Shard* home = m_Owner->GetHome( evt->GetKey() );
+            if ( home != this ) {
+                home->m_MessageQueue->Send( evt );
+                return false;
+            }
+            return Sequencer::ProcessMessage( evt );
+        }
+    };
+    typedef boost::shared_ptr< Shard > ShardPtr;
+
+    std::vector< ShardPtr > m_Shards;
+    // round robin for effects without any key
+    size_t                  m_NextShard;
+    // a broadcast counts and reaches the same shards, see Shard::Retire()
+    boost::mutex            m_BroadcastLock;
+
+    ShardedSequencer( const ShardedSequencer& );
+    ShardedSequencer& operator=( const ShardedSequencer& );
+
+    Shard* GetHome( MessageKey key ) const
+    {
+        // interned keys are sequential, modulo spreads them evenly
+        return m_Shards[ key % m_Shards.size() ].get();
+    }
+
+    void Broadcast( const MessagePtr& state )
+    {
+        boost::mutex::scoped_lock lock(m_BroadcastLock);
+        size_t running(0);
+        for ( size_t i = 0; i < m_Shards.size(); ++i ) {
+            if ( m_Shards[i]->IsRunning() ) ++running;
+        }
+        if ( !running ) return;
+        MessagePtr control( new ControlMessage( state, running ) );
+        for ( size_t i = 0; i < m_Shards.size(); ++i ) {
+            if ( m_Shards[i]->IsRunning() ) m_Shards[i]->GetMessageQueue()->Send( control );
+        }
+    }
+
+public:
+    // shards == 0: one shard per core
+    ShardedSequencer( size_t shards = 0, bool pinned = true )
+        : m_NextShard(0)
+    {
+        size_t cores = std::max( 1u, boost::thread::hardware_concurrency() );
+        if ( shards == 0 ) shards = cores;
+        for ( size_t i = 0; i < shards; ++i ) {
+            m_Shards.push_back( ShardPtr( new Shard( this ) ) );
+            if ( pinned ) m_Shards.back()->SetAffinity( i % cores );
+        }
+    }
+
+    virtual ~ShardedSequencer()
+    {
+        // shards forward to each other, all message threads have to be gone before any shard is
+        Broadcast( StateMessage::Get( Sequencer::TERMINATE ) );
+        for ( size_t i = 0; i < m_Shards.size(); ++i ) {
+            m_Shards[i]->Shutdown();
+        }
+    }
+
+    size_t GetShardCount() const
+    {
+        return m_Shards.size();
+    }
+
+    Sequencer& GetShard( size_t index )
+    {
+        return *m_Shards[index];
+    }
+
+    // any shard's queue will do, messages are forwarded to their home shard
+    MessageQueuePtr GetMessageQueue() const
+    {
+        return m_Shards[0]->GetMessageQueue();
+    }
+
+    void Send( const MessagePtr& msg )
+    {
+        if ( msg->Cast<StateMessage>() ) {
+            Broadcast( msg );
+        } else {
+            GetHome( msg->GetKey() )->GetMessageQueue()->Send( msg );
+        }
+    }
+
+    // not while the sequencer is running
+    SeqEffectPtr Add( SeqEffectPtr t )
+    {
+        MessageKey key;
+        Shard* shard;
+        if ( t->GetTriggerKey( key ) || t->GetOutputKey( key ) ) {
+            shard = GetHome( key );
+        } else {
+            shard = m_Shards[ m_NextShard++ % m_Shards.size() ].get();
+        }
+        return shard->Add( t );
+    }
+
+    ListenerPtr RegisterListener( const ListenerPtr& listener )
+    {
+        MessageKey key;
+        if ( listener->GetEventKey( key ) && !StateMessage::IsStateKey( key ) ) {
+            return GetHome( key )->RegisterLocal( listener );
+        }
+        for ( size_t i = 0; i < m_Shards.size(); ++i ) {
+            m_Shards[i]->RegisterLocal( listener );
+        }
+        return listener;
+    }
+
+    void UnregisterListener( const ListenerPtr& listener )
+    {
+        MessageKey key;
+        if ( listener->GetEventKey( key ) && !StateMessage::IsStateKey( key ) ) {
+            GetHome( key )->UnregisterLocal( listener );
+            return;
+        }
+        for ( size_t i = 0; i < m_Shards.size(); ++i ) {
+            m_Shards[i]->UnregisterLocal( listener );
+        }
+    }
+
+    void Start()
+    {
+        Broadcast( StateMessage::Get( Sequencer::START ) );
+    }
+
+    void Stop()
+    {
+        Broadcast( StateMessage::Get( Sequencer::STOPPED ) );
+    }
+};
+
+#endif /* __SHARDED_SEQUENCER_H__ */
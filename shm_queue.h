@@ -0,0 +1,387 @@
+#ifndef __SHM_QUEUE_H__
+#define __SHM_QUEUE_H__
+
+#include "message_queue.h"
+#include "message_codec.h"
+
+#include <string>
+#include <new>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#ifdef __linux__
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+// the ring is shared between processes, a lock based atomic would only lock in one of them
+BOOST_STATIC_ASSERT( BOOST_ATOMIC_INT32_LOCK_FREE == 2 && BOOST_ATOMIC_INT64_LOCK_FREE == 2 );
+
+class SharedMemoryQueue;
+typedef boost::shared_ptr< SharedMemoryQueue > SharedMemoryQueuePtr;
+
+/* Message queue between processes of one machine: a ring of fixed size slots in POSIX
+ * shared memory, the same sequenced cell scheme as RingBuffer. The consumer process
+ * creates it, any number of producer processes open it by name and Send messages in their
+ * MessageCodec form, encoded straight into the slot. A Send is one CAS and a memcpy; it
+ * only makes a syscall (futex wake) while the consumer is asleep. A full ring or a message
+ * too large for a slot is not queued, Send returns false.
+ * A producer that dies between claiming and publishing a slot stalls the ring.
+ */
+class SharedMemoryQueue
+{
+public:
+    enum { DefaultSlotCount = 4096, DefaultSlotSize = 256, SpinCount = 256 };
+
+private:
+    enum { Magic = 0x53455153, Version = 2, CacheLine = 64 };
+
+    struct Header
+    {
+        boost::atomic< boost::uint32_t > m_Magic;   // set last, once the ring is ready
+        boost::uint32_t                  m_Version;
+        boost::uint32_t                  m_SlotSize;
+        boost::uint32_t                  m_SlotCount;
+        // consumer process, see Create()
+        boost::uint32_t                  m_OwnerPid;
+        char                             m_Pad0[CacheLine - 20];
+        boost::atomic< boost::uint64_t > m_Tail;
+        char                             m_Pad1[CacheLine - 8];
+        boost::atomic< boost::uint64_t > m_Head;
+        char                             m_Pad2[CacheLine - 8];
+        // futex word, bumped to wake the consumer
+        boost::atomic< boost::uint32_t > m_Signal;
+        boost::atomic< boost::uint32_t > m_Waiting;
+    };
+
+    struct Slot
+    {
+        boost::atomic< boost::uint64_t > m_Sequence;
+        // 0: skip, the producer could not encode its message
+        boost::uint32_t                  m_Size;
+        boost::uint32_t                  m_Reserved;
+    };
+
+    std::string                                       m_Name;
+    bool                                              m_Owner;
+    boost::interprocess::mapped_region                m_Region;
+    Header*                                           m_Header;
+    char*                                             m_Slots;
+    size_t                                            m_SlotSize;
+    size_t                                            m_Mask;
+    boost::atomic<bool>                               m_CancelWait;
+    // see SetDecodeFlags()
+    unsigned                                          m_DecodeFlags;
+
+    SharedMemoryQueue( const std::string& name, bool owner )
+        : m_Name(name)
+        , m_Owner(owner)
+        , m_Header(NULL)
+        , m_Slots(NULL)
+        , m_SlotSize(0)
+        , m_Mask(0)
+        , m_CancelWait(false)
+        , m_DecodeFlags(0)
+    {}
+
+    SharedMemoryQueue( const SharedMemoryQueue& );
+    SharedMemoryQueue& operator=( const SharedMemoryQueue& );
+
+    static size_t HeaderSize()
+    {
+        return ( sizeof(Header) + CacheLine - 1 ) & ~size_t( CacheLine - 1 );
+    }
+
+    void Map( boost::interprocess::shared_memory_object& shm )
+    {
+        boost::interprocess::mapped_region region( shm, boost::interprocess::read_write );
+        m_Region.swap( region );
+        m_Header = static_cast< Header* >( m_Region.get_address() );
+        m_Slots  = static_cast< char* >( m_Region.get_address() ) + HeaderSize();
+    }
+
+    Slot* GetSlot( boost::uint64_t pos ) const
+    {
+        return reinterpret_cast< Slot* >( m_Slots + ( pos & m_Mask ) * m_SlotSize );
+    }
+
+    void Wake()
+    {
+        boost::atomic_thread_fence( boost::memory_order_seq_cst );
+        if ( m_Header->m_Waiting.load( boost::memory_order_relaxed ) ) {
+            m_Header->m_Signal.fetch_add( 1, boost::memory_order_release );
+#ifdef __linux__
+            syscall( SYS_futex, &m_Header->m_Signal, FUTEX_WAKE, 1, NULL, NULL, 0 );
+#endif
+        }
+    }
+
+    // consumer; blocks while the futex word is still signal
+    void Sleep( boost::uint32_t signal )
+    {
+#ifdef __linux__
+        syscall( SYS_futex, &m_Header->m_Signal, FUTEX_WAIT, signal, NULL, NULL, 0 );
+#else
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 1 ) );
+#endif
+    }
+
+    // true if there is no queue called name, or one whose consumer process is gone
+    static bool RemoveStale( const std::string& name )
+    {
+        using namespace boost::interprocess;
+        try {
+            shared_memory_object shm( open_only, name.c_str(), read_only );
+            mapped_region region( shm, read_only );
+            if ( region.get_size() < HeaderSize() ) return false;
+            const Header* header = static_cast< const Header* >( region.get_address() );
+            // a header without magic may be a Create() in progress
+            if ( header->m_Magic.load( boost::memory_order_acquire ) != Magic || header->m_Version != Version ) return false;
+#ifdef __linux__
+            if ( header->m_OwnerPid == 0 || kill( (pid_t)header->m_OwnerPid, 0 ) == 0 || errno != ESRCH ) return false;
+#else
+            return false;
+#endif
+        } catch ( const interprocess_exception& ) {
+            return true;
+        }
+        return shared_memory_object::remove( name.c_str() );
+    }
+
+    bool HasIncoming() const
+    {
+        boost::uint64_t pos = m_Header->m_Head.load( boost::memory_order_relaxed );
+        return GetSlot( pos )->m_Sequence.load( boost::memory_order_acquire ) == pos + 1;
+    }
+
+public:
+    /* Consumer side. Replaces a queue of the same name left behind by a crashed process;
+     * fails while its consumer still runs, or if that can't be told (not on Linux).
+     * Slot size includes a 16 byte slot header, it is rounded up to the cache line.
+     */
+    static SharedMemoryQueuePtr Create( const std::string& name, size_t slotCount = DefaultSlotCount, size_t slotSize = DefaultSlotSize )
+    {
+        using namespace boost::interprocess;
+        try {
+            size_t count = 2;
+            while ( count < slotCount ) count <<= 1;
+            slotSize = ( std::max( slotSize, sizeof(Slot) + sizeof(MessageCodec::WireHeader) ) + CacheLine - 1 ) & ~size_t( CacheLine - 1 );
+
+            if ( !RemoveStale( name ) ) return SharedMemoryQueuePtr();
+            shared_memory_object shm( create_only, name.c_str(), read_write );
+            shm.truncate( HeaderSize() + count * slotSize );
+
+            SharedMemoryQueuePtr queue( new SharedMemoryQueue( name, true ) );
+            queue->Map( shm );
+            Header* header = new (queue->m_Header) Header;
+            header->m_Version   = Version;
+            header->m_SlotSize  = (boost::uint32_t)slotSize;
+            header->m_SlotCount = (boost::uint32_t)count;
+#ifdef __linux__
+            header->m_OwnerPid  = (boost::uint32_t)getpid();
+#else
+            header->m_OwnerPid  = 0;
+#endif
+            header->m_Tail.store( 0, boost::memory_order_relaxed );
+            header->m_Head.store( 0, boost::memory_order_relaxed );
+            header->m_Signal.store( 0, boost::memory_order_relaxed );
+            header->m_Waiting.store( 0, boost::memory_order_relaxed );
+            queue->m_SlotSize = slotSize;
+            queue->m_Mask     = count - 1;
+            for ( size_t i = 0; i < count; ++i ) {
+                Slot* slot = new (queue->GetSlot( i )) Slot;
+                slot->m_Sequence.store( i, boost::memory_order_relaxed );
+                slot->m_Size = 0;
+            }
+            header->m_Magic.store( Magic, boost::memory_order_release );
+            return queue;
+        } catch ( const interprocess_exception& ) {
+            return SharedMemoryQueuePtr();
+        }
+    }
+
+    // producer side; an empty pointer if there is no such queue (yet)
+    static SharedMemoryQueuePtr Open( const std::string& name )
+    {
+        using namespace boost::interprocess;
+        try {
+            shared_memory_object shm( open_only, name.c_str(), read_write );
+            SharedMemoryQueuePtr queue( new SharedMemoryQueue( name, false ) );
+            queue->Map( shm );
+            Header* header = queue->m_Header;
+            if ( queue->m_Region.get_size() < HeaderSize()
+                 || header->m_Magic.load( boost::memory_order_acquire ) != Magic
+                 || header->m_Version != Version ) {
+                return SharedMemoryQueuePtr();
+            }
+            // don't trust the header further than the mapping goes
+            size_t count    = header->m_SlotCount;
+            size_t slotSize = header->m_SlotSize;
+            if ( count == 0 || ( count & ( count - 1 ) ) != 0
+                 || slotSize < sizeof(Slot) + sizeof(MessageCodec::WireHeader) || ( slotSize & 7 ) != 0
+                 || ( queue->m_Region.get_size() - HeaderSize() ) / count < slotSize ) {
+                return SharedMemoryQueuePtr();
+            }
+            queue->m_SlotSize = slotSize;
+            queue->m_Mask     = count - 1;
+            return queue;
+        } catch ( const interprocess_exception& ) {
+            return SharedMemoryQueuePtr();
+        }
+    }
+
+    ~SharedMemoryQueue()
+    {
+        if ( m_Owner ) boost::interprocess::shared_memory_object::remove( m_Name.c_str() );
+    }
+
+    const std::string& GetName() const
+    {
+        return m_Name;
+    }
+
+    // largest encoded message a slot holds
+    size_t GetMaxMessageSize() const
+    {
+        return m_SlotSize - sizeof(Slot);
+    }
+
+    // any process; false if the ring is full or msg can't be encoded into a slot
+    bool Send( const MessagePtr& msg )
+    {
+        if ( !msg ) return false;
+        boost::uint64_t pos = m_Header->m_Tail.load( boost::memory_order_relaxed );
+        Slot* slot;
+        for (;;) {
+            slot = GetSlot( pos );
+            boost::uint64_t seq = slot->m_Sequence.load( boost::memory_order_acquire );
+            boost::int64_t diff = (boost::int64_t)( seq - pos );
+            if ( diff == 0 ) {
+                if ( m_Header->m_Tail.compare_exchange_weak( pos, pos + 1, boost::memory_order_relaxed ) ) break;
+            } else if ( diff < 0 ) {
+                return false;
+            } else {
+                pos = m_Header->m_Tail.load( boost::memory_order_relaxed );
+            }
+        }
+        // the slot is claimed, it has to be published even if encoding fails
+        slot->m_Size = (boost::uint32_t)MessageCodec::Encode( *msg, reinterpret_cast< char* >( slot + 1 ), GetMaxMessageSize() );
+        slot->m_Sequence.store( pos + 1, boost::memory_order_release );
+        Wake();
+        return slot->m_Size != 0;
+    }
+
+    /* Consumer process only, like all of the following. Any local process that can open the
+     * shared memory object is a producer, so by default names the consumer doesn't know are
+     * refused and so are state messages. See MessageCodec::DecodeFlags.
+     */
+    void SetDecodeFlags( unsigned flags )
+    {
+        m_DecodeFlags = flags;
+    }
+
+    MessagePtr Poll()
+    {
+        for (;;) {
+            boost::uint64_t pos = m_Header->m_Head.load( boost::memory_order_relaxed );
+            Slot* slot = GetSlot( pos );
+            if ( slot->m_Sequence.load( boost::memory_order_acquire ) != pos + 1 ) return MessagePtr();
+            MessagePtr msg;
+            // read once, the producer may still write to it; skip sizes that leave the slot
+            boost::uint32_t size = *static_cast< volatile boost::uint32_t* >( &slot->m_Size );
+            if ( size != 0 && size <= GetMaxMessageSize() ) {
+                msg = MessageCodec::Decode( reinterpret_cast< const char* >( slot + 1 ), size, m_DecodeFlags );
+            }
+            slot->m_Sequence.store( pos + m_Mask + 1, boost::memory_order_release );
+            m_Header->m_Head.store( pos + 1, boost::memory_order_relaxed );
+            if ( msg ) return msg;
+        }
+    }
+
+    size_t PollBatch( MessageQueue::ValueList& out, size_t max )
+    {
+        size_t count(0);
+        MessagePtr msg;
+        while ( count < max && ( msg = Poll() ) ) {
+            out.push_back( msg );
+            ++count;
+        }
+        return count;
+    }
+
+    // spins briefly, then sleeps on the futex; NULL once canceled
+    MessagePtr Wait()
+    {
+        for (;;) {
+            for ( size_t spin = 0; spin < SpinCount; ++spin ) {
+                if ( m_CancelWait.load( boost::memory_order_relaxed ) ) return MessagePtr();
+                MessagePtr msg = Poll();
+                if ( msg ) return msg;
+            }
+            m_Header->m_Waiting.store( 1, boost::memory_order_relaxed );
+            boost::uint32_t signal = m_Header->m_Signal.load( boost::memory_order_acquire );
+            boost::atomic_thread_fence( boost::memory_order_seq_cst );
+            if ( !HasIncoming() && !m_CancelWait.load( boost::memory_order_relaxed ) ) Sleep( signal );
+            m_Header->m_Waiting.store( 0, boost::memory_order_relaxed );
+        }
+    }
+
+    void CancelWait()
+    {
+        m_CancelWait.store( true, boost::memory_order_relaxed );
+        m_Header->m_Waiting.store( 1, boost::memory_order_relaxed );
+        Wake();
+    }
+};
+
+/* Feeds a SharedMemoryQueue into a local MessageQueue (e.g. a Sequencer's) on a thread of
+ * its own, for as long as it exists. Decoded messages are forwarded in batches, one wakeup
+ * of the target per burst.
+ */
+class SharedMemoryBridge
+{
+    SharedMemoryQueuePtr               m_Source;
+    MessageQueuePtr                    m_Target;
+    boost::scoped_ptr< boost::thread > m_Thread;
+
+    SharedMemoryBridge( const SharedMemoryBridge& );
+    SharedMemoryBridge& operator=( const SharedMemoryBridge& );
+
+    void Run()
+    {
+        MessageQueue::ValueList batch;
+        while ( MessagePtr msg = m_Source->Wait() ) {
+            batch.push_back( msg );
+            m_Source->PollBatch( batch, MessageQueue::BatchChunk - 1 );
+            m_Target->SendBatch( batch );
+            batch.clear();
+        }
+    }
+
+public:
+    SharedMemoryBridge( const SharedMemoryQueuePtr& source, const MessageQueuePtr& target )
+        : m_Source(source)
+        , m_Target(target)
+    {
+        m_Thread.reset( new boost::thread( boost::bind( &SharedMemoryBridge::Run, this ) ) );
+    }
+
+    ~SharedMemoryBridge()
+    {
+        m_Source->CancelWait();
+        m_Thread->join();
+    }
+};
+
+#endif /* __SHM_QUEUE_H__ */
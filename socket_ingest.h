@@ -0,0 +1,264 @@
+#ifndef __SOCKET_INGEST_H__
+#define __SOCKET_INGEST_H__
+
+#include "message_queue.h"
+#include "message_codec.h"
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include <boost/asio.hpp>
+#include <boost/asio/generic/datagram_protocol.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+class SocketIngest;
+typedef boost::shared_ptr< SocketIngest > SocketIngestPtr;
+
+/* Reads event datagrams from a UDP or Unix domain socket on an io_service (usually the
+ * sequencer's, see Sequencer::GetIOService()) and queues them as messages. Once the socket
+ * is readable up to BatchSize datagrams are taken with one recvmmsg call and queued with
+ * one MessageQueueT::SendBatch, there is no thread and no lock per datagram.
+ *
+ *     SocketIngestPtr ingest = SocketIngest::Create( seq.GetIOService(), seq.GetMessageQueue() );
+ *     ingest->OpenUdp( "127.0.0.1", 9000 );
+ *
+ * Datagrams hold a MessageCodec encoding, or with FORMAT_TEXT just a key which becomes a
+ * StringMessage. Keys the process does not know yet and state messages are refused unless
+ * allowed with SetDecodeFlags(). Created through Create(), pending handlers keep the object
+ * alive.
+ */
+class SocketIngest : public boost::enable_shared_from_this< SocketIngest >
+{
+public:
+    enum Format
+    {
+        FORMAT_CODEC,
+        FORMAT_TEXT
+    };
+
+    enum { BatchSize = 64, MaxDatagramSize = 2048, MaxBatchesPerWakeup = 16 };
+
+    struct IngestStats
+    {
+        boost::uint64_t m_Received;
+        boost::uint64_t m_Invalid;  // truncated, not decodable or refused, see SetDecodeFlags()
+        boost::uint64_t m_Dropped;  // refused by the queue
+    };
+
+private:
+    typedef boost::asio::generic::datagram_protocol Protocol;
+
+    boost::asio::io_service&         m_IOService;
+    MessageQueuePtr                  m_Queue;
+    Format                           m_Format;
+    unsigned                         m_DecodeFlags;
+    Protocol::socket                 m_Socket;
+    std::string                      m_UnixPath;
+
+    std::vector< char >              m_Buffers;
+    MessageQueue::ValueList          m_Batch;
+#ifdef __linux__
+    std::vector< mmsghdr >           m_Headers;
+    std::vector< iovec >             m_Vectors;
+#endif
+
+    boost::atomic< boost::uint64_t > m_Received;
+    boost::atomic< boost::uint64_t > m_Invalid;
+    boost::atomic< boost::uint64_t > m_Dropped;
+
+    SocketIngest( boost::asio::io_service& io, const MessageQueuePtr& queue, Format format )
+        : m_IOService(io)
+        , m_Queue(queue)
+        , m_Format(format)
+        , m_DecodeFlags(0)
+        , m_Socket(io)
+        , m_Buffers( BatchSize * MaxDatagramSize )
+        , m_Received(0)
+        , m_Invalid(0)
+        , m_Dropped(0)
+    {
+        m_Batch.reserve( BatchSize );
+#ifdef __linux__
+        m_Headers.resize( BatchSize );
+        m_Vectors.resize( BatchSize );
+        for ( size_t i = 0; i < BatchSize; ++i ) {
+            m_Vectors[i].iov_base = &m_Buffers[ i * MaxDatagramSize ];
+            m_Vectors[i].iov_len  = MaxDatagramSize;
+        }
+#endif
+    }
+
+    SocketIngest( const SocketIngest& );
+    SocketIngest& operator=( const SocketIngest& );
+
+    bool Open( const Protocol::endpoint& endpoint )
+    {
+        boost::system::error_code error;
+        m_Socket.open( endpoint.protocol(), error );
+        if ( !error ) m_Socket.bind( endpoint, error );
+        if ( !error ) m_Socket.non_blocking( true, error );
+        if ( error ) {
+            m_Socket.close( error );
+            return false;
+        }
+        Arm();
+        return true;
+    }
+
+    void Arm()
+    {
+        m_Socket.async_wait( Protocol::socket::wait_read,
+                             boost::bind( &SocketIngest::OnReadable, shared_from_this(), boost::asio::placeholders::error ) );
+    }
+
+    void Decode( const char* data, size_t size, bool truncated )
+    {
+        m_Received.fetch_add( 1, boost::memory_order_relaxed );
+        MessagePtr msg;
+        if ( !truncated ) {
+            if ( m_Format == FORMAT_TEXT ) {
+                std::string name( data, size );
+                MessageKey key;
+                if ( MessageCodec::LookupName( name, m_DecodeFlags, key ) ) msg = new StringMessage( name.c_str() );
+            } else {
+                msg = MessageCodec::Decode( data, size, m_DecodeFlags );
+            }
+        }
+        if ( msg ) {
+            m_Batch.push_back( msg );
+        } else {
+            m_Invalid.fetch_add( 1, boost::memory_order_relaxed );
+        }
+    }
+
+    // reads one batch of datagrams, returns the number read
+    size_t Receive()
+    {
+#ifdef __linux__
+        for ( size_t i = 0; i < BatchSize; ++i ) {
+            m_Headers[i].msg_hdr.msg_name       = NULL;
+            m_Headers[i].msg_hdr.msg_namelen    = 0;
+            m_Headers[i].msg_hdr.msg_iov        = &m_Vectors[i];
+            m_Headers[i].msg_hdr.msg_iovlen     = 1;
+            m_Headers[i].msg_hdr.msg_control    = NULL;
+            m_Headers[i].msg_hdr.msg_controllen = 0;
+            m_Headers[i].msg_hdr.msg_flags      = 0;
+        }
+        int count = recvmmsg( m_Socket.native_handle(), &m_Headers[0], BatchSize, MSG_DONTWAIT, NULL );
+        if ( count <= 0 ) return 0;
+        for ( int i = 0; i < count; ++i ) {
+            Decode( &m_Buffers[ i * MaxDatagramSize ], m_Headers[i].msg_len, ( m_Headers[i].msg_hdr.msg_flags & MSG_TRUNC ) != 0 );
+        }
+        return count;
+#else
+        size_t count(0);
+        boost::system::error_code error;
+        for ( ; count < BatchSize; ++count ) {
+            size_t size = m_Socket.receive( boost::asio::buffer( &m_Buffers[0], MaxDatagramSize ), 0, error );
+            if ( error ) break;
+            Decode( &m_Buffers[0], size, false );
+        }
+        return count;
+#endif
+    }
+
+    void OnReadable( const boost::system::error_code& error )
+    {
+        if ( error ) return; // closed
+        for ( size_t round = 0; round < MaxBatchesPerWakeup; ++round ) {
+            size_t count = Receive();
+            if ( !m_Batch.empty() ) {
+                size_t sent = m_Queue->SendBatch( m_Batch );
+                if ( sent < m_Batch.size() ) m_Dropped.fetch_add( m_Batch.size() - sent, boost::memory_order_relaxed );
+                m_Batch.clear();
+            }
+            if ( count < BatchSize ) break;
+        }
+        // don't starve the timing wheel on the same reactor, wait for the next wakeup
+        Arm();
+    }
+
+    void DoClose()
+    {
+        boost::system::error_code error;
+        m_Socket.close( error );
+        if ( !m_UnixPath.empty() ) std::remove( m_UnixPath.c_str() );
+        m_UnixPath.clear();
+    }
+
+public:
+    static SocketIngestPtr Create( boost::asio::io_service& io, const MessageQueuePtr& queue, Format format = FORMAT_CODEC )
+    {
+        return SocketIngestPtr( new SocketIngest( io, queue, format ) );
+    }
+
+    ~SocketIngest()
+    {
+        DoClose();
+    }
+
+    // binds to address:port, returns false on error
+    bool OpenUdp( const std::string& address, unsigned short port )
+    {
+        boost::system::error_code error;
+        boost::asio::ip::address ip = boost::asio::ip::address::from_string( address, error );
+        if ( error ) return false;
+        return Open( Protocol::endpoint( boost::asio::ip::udp::endpoint( ip, port ) ) );
+    }
+
+    // binds to a Unix datagram socket at path, replacing a stale one
+    bool OpenUnix( const std::string& path )
+    {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        std::remove( path.c_str() );
+        if ( !Open( Protocol::endpoint( boost::asio::local::datagram_protocol::endpoint( path ) ) ) ) return false;
+        m_UnixPath = path;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /* MessageCodec::DecodeFlags, set before Open*(). Only for senders you trust: with
+     * DECODE_INTERN every new key name costs memory for the life of the process, with
+     * DECODE_STATE a datagram can stop or terminate the sequencer.
+     */
+    void SetDecodeFlags( unsigned flags )
+    {
+        m_DecodeFlags = flags;
+    }
+
+    // kernel side buffer for bursts, after Open*(); the kernel drops datagrams once it is full
+    bool SetReceiveBufferSize( int bytes )
+    {
+        boost::system::error_code error;
+        m_Socket.set_option( boost::asio::socket_base::receive_buffer_size( bytes ), error );
+        return !error;
+    }
+
+    // runs on the io_service, i.e. never races a handler
+    void Close()
+    {
+        m_IOService.post( boost::bind( &SocketIngest::DoClose, shared_from_this() ) );
+    }
+
+    IngestStats GetStats() const
+    {
+        IngestStats stats;
+        stats.m_Received = m_Received.load( boost::memory_order_relaxed );
+        stats.m_Invalid  = m_Invalid.load( boost::memory_order_relaxed );
+        stats.m_Dropped  = m_Dropped.load( boost::memory_order_relaxed );
+        return stats;
+    }
+};
+
+#endif /* __SOCKET_INGEST_H__ */
@@ -0,0 +1,329 @@
+#ifndef __TIMING_WHEEL_H__
+#define __TIMING_WHEEL_H__
+
+#include <vector>
+#include <cstddef>
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+/* Hierarchical timing wheel (4 levels x 256 slots, see Varghese & Lauck).
+ * Insert and cancel are O(1), entries of a level cascade down once per 256 ticks of the
+ * level below. The wheel is passive: whoever owns it calls Advance() with the current tick
+ * and sleeps until the tick Advance() returns (or until Schedule() asks for an earlier
+ * wakeup). Expired entries of a tick are fired as one batch while the wheel lock is held,
+ * so once Cancel() returns the callback will not run.
+ * Callbacks may (re)schedule or cancel entries of the same wheel. They must not block: a
+ * blocked callback holds up every later timer, Schedule() on other threads and whatever
+ * else shares the owner's thread (e.g. SocketIngest). Timed effects must therefore not
+ * send into an OVERFLOW_BLOCK queue; its block timeout only bounds the stall.
+ */
+class TimingWheel
+{
+public:
+    typedef boost::uint64_t            Tick;
+    typedef boost::function< void () > Callback;
+
+    class Entry
+    {
+        friend class TimingWheel;
+
+        enum State { IDLE, LINKED, FIRING };
+
+        Entry*       m_Next;
+        Entry**      m_PPrev;
+        TimingWheel* m_Wheel;
+        Tick         m_Expiry;
+        unsigned     m_Epoch;
+        State        m_State;
+        size_t       m_BatchIndex;
+        Callback     m_Callback;
+
+        Entry( const Entry& );
+        Entry& operator=( const Entry& );
+    public:
+        Entry()
+            : m_Next(NULL), m_PPrev(NULL), m_Wheel(NULL), m_Expiry(0), m_Epoch(0), m_State(IDLE), m_BatchIndex(0)
+        {}
+
+        explicit Entry( const Callback& func )
+            : m_Next(NULL), m_PPrev(NULL), m_Wheel(NULL), m_Expiry(0), m_Epoch(0), m_State(IDLE), m_BatchIndex(0)
+            , m_Callback(func)
+        {}
+
+        ~Entry()
+        {
+            Cancel();
+        }
+
+        // not while the entry is scheduled
+        void SetCallback( const Callback& func ) { m_Callback = func; }
+
+        Tick GetExpiry() const { return m_Expiry; }
+
+        void Cancel()
+        {
+            if ( m_Wheel ) m_Wheel->Cancel( *this );
+        }
+    };
+
+    enum
+    {
+        LevelBits  = 8,
+        SlotCount  = 1 << LevelBits,
+        SlotMask   = SlotCount - 1,
+        LevelCount = 4
+    };
+
+private:
+    mutable boost::recursive_mutex m_Lock;
+    Entry*                         m_Slots[LevelCount][SlotCount];
+    // next tick to be processed
+    Tick                           m_Now;
+    // number of scheduled entries of the current epoch
+    size_t                         m_Live;
+    unsigned                       m_Epoch;
+    // true while the owner is ticking the wheel, m_WakeTick is its next wakeup
+    bool                           m_Driven;
+    Tick                           m_WakeTick;
+    // callbacks run so far
+    boost::uint64_t                m_Fired;
+    std::vector< Entry* >          m_Batch;
+
+    TimingWheel( const TimingWheel& );
+    TimingWheel& operator=( const TimingWheel& );
+
+    static void Link( Entry*& head, Entry& entry )
+    {
+        entry.m_Next = head;
+        if ( head ) head->m_PPrev = &entry.m_Next;
+        head = &entry;
+        entry.m_PPrev = &head;
+    }
+
+    static void Unlink( Entry& entry )
+    {
+        *entry.m_PPrev = entry.m_Next;
+        if ( entry.m_Next ) entry.m_Next->m_PPrev = entry.m_PPrev;
+        entry.m_Next  = NULL;
+        entry.m_PPrev = NULL;
+    }
+
+    void Detach( Entry& entry )
+    {
+        if ( entry.m_State == Entry::LINKED ) {
+            Unlink( entry );
+            if ( entry.m_Epoch == m_Epoch ) --m_Live;
+        } else if ( entry.m_State == Entry::FIRING ) {
+            m_Batch[ entry.m_BatchIndex ] = NULL;
+        }
+        entry.m_State = Entry::IDLE;
+    }
+
+    void Insert( Entry& entry )
+    {
+        Tick expiry = entry.m_Expiry;
+        Tick delta  = expiry > m_Now ? expiry - m_Now : 0;
+        Entry** slot;
+        if ( delta < ( Tick(1) << LevelBits ) ) {
+            slot = &m_Slots[0][ ( delta ? expiry : m_Now ) & SlotMask ];
+        } else if ( delta < ( Tick(1) << ( 2 * LevelBits ) ) ) {
+            slot = &m_Slots[1][ ( expiry >> LevelBits ) & SlotMask ];
+        } else if ( delta < ( Tick(1) << ( 3 * LevelBits ) ) ) {
+            slot = &m_Slots[2][ ( expiry >> ( 2 * LevelBits ) ) & SlotMask ];
+        } else {
+            // entries beyond the wheel's range park in the top level and get re-inserted
+            if ( delta >= ( Tick(1) << ( 4 * LevelBits ) ) ) expiry = m_Now + ( Tick(1) << ( 4 * LevelBits ) ) - 1;
+            slot = &m_Slots[3][ ( expiry >> ( 3 * LevelBits ) ) & SlotMask ];
+        }
+        Link( *slot, entry );
+        entry.m_State = Entry::LINKED;
+    }
+
+    // moves all entries of the current slot of a level down, returns the slot index
+    size_t Cascade( size_t level )
+    {
+        size_t index = ( m_Now >> ( level * LevelBits ) ) & SlotMask;
+        Entry* entry = m_Slots[level][index];
+        m_Slots[level][index] = NULL;
+        while ( entry ) {
+            Entry* next = entry->m_Next;
+            entry->m_Next  = NULL;
+            entry->m_PPrev = NULL;
+            if ( entry->m_Epoch == m_Epoch ) {
+                Insert( *entry );
+            } else {
+                entry->m_State = Entry::IDLE;
+            }
+            entry = next;
+        }
+        return index;
+    }
+
+public:
+    TimingWheel()
+        : m_Now(0)
+        , m_Live(0)
+        , m_Epoch(0)
+        , m_Driven(false)
+        , m_WakeTick(0)
+        , m_Fired(0)
+    {
+        for ( size_t l = 0; l < LevelCount; ++l ) {
+            for ( size_t s = 0; s < SlotCount; ++s ) m_Slots[l][s] = NULL;
+        }
+    }
+
+    ~TimingWheel()
+    {
+        // entries may outlive the wheel, make their Cancel() a no-op
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        for ( size_t l = 0; l < LevelCount; ++l ) {
+            for ( size_t s = 0; s < SlotCount; ++s ) {
+                Entry* entry = m_Slots[l][s];
+                while ( entry ) {
+                    Entry* next = entry->m_Next;
+                    entry->m_Next  = NULL;
+                    entry->m_PPrev = NULL;
+                    entry->m_State = Entry::IDLE;
+                    entry->m_Wheel = NULL;
+                    entry = next;
+                }
+                m_Slots[l][s] = NULL;
+            }
+        }
+    }
+
+    /* Schedules (or re-schedules) entry to fire at tick expiry; now is the caller's current tick.
+     * Returns true if the owner has to wake up earlier than planned (or start ticking at all).
+     */
+    bool Schedule( Entry& entry, Tick expiry, Tick now )
+    {
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        if ( entry.m_Wheel && entry.m_Wheel != this ) entry.Cancel();
+        Detach( entry );
+        // nothing pending: catch up with the caller's clock instead of stepping through idle ticks
+        if ( m_Live == 0 && now > m_Now ) m_Now = now;
+
+        entry.m_Wheel  = this;
+        entry.m_Expiry = expiry;
+        entry.m_Epoch  = m_Epoch;
+        Insert( entry );
+        ++m_Live;
+
+        if ( m_Driven && expiry >= m_WakeTick ) return false;
+        m_Driven   = true;
+        m_WakeTick = expiry;
+        return true;
+    }
+
+    void Cancel( Entry& entry )
+    {
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        if ( entry.m_Wheel == this ) Detach( entry );
+    }
+
+    // cancels every scheduled entry at once; stale entries are dropped lazily
+    void CancelAll()
+    {
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        ++m_Epoch;
+        m_Live = 0;
+        for ( size_t i = 0; i < m_Batch.size(); ++i ) {
+            if ( m_Batch[i] ) {
+                m_Batch[i]->m_State = Entry::IDLE;
+                m_Batch[i] = NULL;
+            }
+        }
+    }
+
+    bool IsEmpty() const
+    {
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        return m_Live == 0;
+    }
+
+    size_t Size() const
+    {
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        return m_Live;
+    }
+
+    boost::uint64_t GetFiredCount() const
+    {
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        return m_Fired;
+    }
+
+    /* Processes all ticks up to and including now and fires what expired, one batch per tick.
+     * Returns false (and stops being driven) once the wheel ran empty, otherwise next is the
+     * tick the owner should call Advance() again.
+     */
+    bool Advance( Tick now, Tick& next )
+    {
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        while ( m_Live > 0 && m_Now <= now ) {
+            size_t index = m_Now & SlotMask;
+            if ( !index && !Cascade(1) && !Cascade(2) ) Cascade(3);
+
+            Entry* entry = m_Slots[0][index];
+            m_Slots[0][index] = NULL;
+            Tick tick = m_Now++;
+
+            m_Batch.clear();
+            while ( entry ) {
+                Entry* next = entry->m_Next;
+                entry->m_Next  = NULL;
+                entry->m_PPrev = NULL;
+                if ( entry->m_Epoch != m_Epoch ) {
+                    entry->m_State = Entry::IDLE;
+                } else if ( entry->m_Expiry > tick ) {
+                    // was parked beyond the wheel's range
+                    Insert( *entry );
+                } else {
+                    --m_Live;
+                    entry->m_State      = Entry::FIRING;
+                    entry->m_BatchIndex = m_Batch.size();
+                    m_Batch.push_back( entry );
+                }
+                entry = next;
+            }
+            for ( size_t i = 0; i < m_Batch.size(); ++i ) {
+                Entry* fire = m_Batch[i];
+                // canceled or re-scheduled by an earlier callback of this batch
+                if ( !fire ) continue;
+                m_Batch[i] = NULL;
+                fire->m_State = Entry::IDLE;
+                ++m_Fired;
+                if ( fire->m_Callback ) fire->m_Callback();
+            }
+            m_Batch.clear();
+        }
+        if ( m_Live == 0 ) {
+            if ( now >= m_Now ) m_Now = now + 1;
+            m_Driven = false;
+            return false;
+        }
+        next = NextTick();
+        m_WakeTick = next;
+        return true;
+    }
+
+    // earliest tick at which Advance() may have something to do
+    Tick NextTick() const
+    {
+        boost::recursive_mutex::scoped_lock lock(m_Lock);
+        Tick tick = m_Now;
+        // a cascade is due first
+        if ( ( tick & SlotMask ) == 0 ) return tick;
+        do {
+            if ( m_Slots[0][ tick & SlotMask ] ) return tick;
+            ++tick;
+        } while ( tick & SlotMask );
+        return tick;
+    }
+};
+
+#endif /* __TIMING_WHEEL_H__ */
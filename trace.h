@@ -0,0 +1,415 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "message_queue.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/chrono.hpp>
+#include <boost/bind.hpp>
+
+/* Compile time trace level; trace points above it compile to nothing.
+ * At runtime Tracer::SetLevel() / Tracer::Open() pick the level, a disabled trace
+ * point costs one relaxed load and a branch.
+ */
+#ifndef SEQ_TRACE_LEVEL
+#define SEQ_TRACE_LEVEL 3
+#endif
+
+#define SEQ_TRACE( level, kind, key, arg ) \
+    do { \
+        if ( (level) <= SEQ_TRACE_LEVEL && Tracer::IsEnabled(level) ) Tracer::Record( (level), (kind), (key), (arg) ); \
+    } while (0)
+
+/* Fixed size binary trace record. The message key is the process local interned key,
+ * see MessageSymbols. The file starts with a TraceFileHeader followed by records; Close()
+ * appends the key names (TraceSymbolHeader, then per key: uint32 key, uint32 size, name)
+ * and points the header at them. See TraceReader.
+ */
+struct TraceRecord
+{
+    boost::uint64_t m_Time;     // steady clock, nanoseconds
+    boost::uint32_t m_Thread;   // tracer's thread index
+    boost::uint16_t m_Kind;
+    boost::uint16_t m_Level;
+    boost::uint32_t m_Key;
+    boost::int32_t  m_Arg;
+};
+
+struct TraceFileHeader
+{
+    char            m_Magic[8]; // "SEQTRACE"
+    boost::uint32_t m_Version;
+    boost::uint32_t m_RecordSize;
+    // file offset of the TraceSymbolHeader, 0 if the trace was not closed
+    boost::uint64_t m_SymbolOffset;
+};
+
+struct TraceSymbolHeader
+{
+    char            m_Magic[8]; // "SEQSYMBS"
+    boost::uint32_t m_Count;
+    boost::uint32_t m_Reserved;
+};
+
+template<int N>
+struct TraceLevelHolder
+{
+    // constant initialized, no guard on the hot path
+    static boost::atomic<int> s_Level;
+};
+template<int N> boost::atomic<int> TraceLevelHolder<N>::s_Level(0);
+
+class Tracer
+{
+public:
+    enum Levels
+    {
+        TRACE_OFF      = 0,
+        TRACE_STATE    = 1,     // sequencer state changes
+        TRACE_MESSAGES = 2,     // every message the sequencer dispatches
+        TRACE_EFFECTS  = 3,     // every effect notification
+        TRACE_ALL      = TRACE_EFFECTS
+    };
+
+    enum Kinds
+    {
+        KIND_RECEIVED      = 1, // arg: sequencer state
+        KIND_TIMED_NOTIFY  = 2, // arg: repeat counter
+        KIND_EVENT_NOTIFY  = 3, // arg: repeat counter
+        KIND_STATE         = 4  // arg: new sequencer state
+    };
+
+    enum { RingSize = 4096, FlushIntervalMs = 10, Version = 2 };
+
+private:
+    // single producer (the owning thread), single consumer (the flusher)
+    struct ThreadRing
+    {
+        TraceRecord            m_Records[RingSize];
+        boost::atomic<size_t>  m_Head;
+        boost::atomic<size_t>  m_Tail;
+        boost::atomic<size_t>  m_Dropped;
+        boost::atomic<bool>    m_Retired;
+        boost::uint32_t        m_Thread;
+
+        ThreadRing( boost::uint32_t thread ) : m_Head(0), m_Tail(0), m_Dropped(0), m_Retired(false), m_Thread(thread) {}
+    };
+    typedef boost::shared_ptr< ThreadRing > ThreadRingPtr;
+
+    boost::mutex                            m_Lock;
+    boost::condition_variable               m_ConditionVar;
+    std::vector< ThreadRingPtr >            m_Rings;
+    boost::uint32_t                         m_NextThread;
+    // records dropped by rings which are gone
+    size_t                                  m_DroppedGone;
+    boost::thread_specific_ptr< ThreadRing > m_ThreadRing;
+    FILE*                                   m_File;
+    bool                                    m_Stop;
+    boost::scoped_ptr< boost::thread >      m_Flusher;
+
+    Tracer() : m_NextThread(0), m_DroppedGone(0), m_ThreadRing( &Tracer::RetireRing ), m_File(NULL), m_Stop(false) {}
+
+    static Tracer& Instance()
+    {
+        // never destroyed, threads may still trace during static destruction
+        static Tracer* tracer = new Tracer;
+        return *tracer;
+    }
+
+    // thread exit; while a file is open the flusher drops the ring once it is drained
+    static void RetireRing( ThreadRing* ring )
+    {
+        Tracer& tracer = Instance();
+        boost::mutex::scoped_lock lock(tracer.m_Lock);
+        if ( tracer.m_File ) {
+            ring->m_Retired.store( true, boost::memory_order_release );
+        } else {
+            tracer.DropRing( ring );
+        }
+    }
+
+    // under m_Lock
+    void DropRing( ThreadRing* ring )
+    {
+        for ( size_t i = 0; i < m_Rings.size(); ++i ) {
+            if ( m_Rings[i].get() == ring ) {
+                m_DroppedGone += ring->m_Dropped.load( boost::memory_order_relaxed );
+                m_Rings.erase( m_Rings.begin() + i );
+                return;
+            }
+        }
+    }
+
+    // NULL while no file is open, nobody would drain a new ring
+    ThreadRing* GetRing()
+    {
+        ThreadRing* ring = m_ThreadRing.get();
+        if ( !ring ) {
+            boost::mutex::scoped_lock lock(m_Lock);
+            if ( !m_File ) return NULL;
+            ThreadRingPtr newRing( new ThreadRing( m_NextThread++ ) );
+            m_Rings.push_back( newRing );
+            ring = newRing.get();
+            m_ThreadRing.reset( ring );
+        }
+        return ring;
+    }
+
+    // flusher thread or Close(); returns true if the ring may be dropped
+    bool Drain( ThreadRing& ring )
+    {
+        bool retired = ring.m_Retired.load( boost::memory_order_acquire );
+        size_t tail = ring.m_Tail.load( boost::memory_order_relaxed );
+        size_t head = ring.m_Head.load( boost::memory_order_acquire );
+        while ( tail != head ) {
+            size_t index = tail % RingSize;
+            size_t count = std::min( head - tail, (size_t)RingSize - index );
+            if ( m_File ) fwrite( &ring.m_Records[index], sizeof(TraceRecord), count, m_File );
+            tail += count;
+        }
+        ring.m_Tail.store( tail, boost::memory_order_release );
+        return retired;
+    }
+
+    void DrainAll()
+    {
+        std::vector< ThreadRingPtr > rings;
+        {
+            boost::mutex::scoped_lock lock(m_Lock);
+            rings = m_Rings;
+        }
+        std::vector< ThreadRingPtr > retired;
+        for ( size_t i = 0; i < rings.size(); ++i ) {
+            if ( Drain( *rings[i] ) ) retired.push_back( rings[i] );
+        }
+        if ( m_File ) fflush( m_File );
+        if ( !retired.empty() ) {
+            boost::mutex::scoped_lock lock(m_Lock);
+            for ( size_t i = 0; i < retired.size(); ++i ) DropRing( retired[i].get() );
+        }
+    }
+
+    // after the last record: the key names, then the header points at them
+    void WriteSymbols()
+    {
+        long offset = ftell( m_File );
+        if ( offset < 0 ) return;
+        size_t count = MessageSymbols::GetCount();
+        TraceSymbolHeader symbols = { { 'S','E','Q','S','Y','M','B','S' }, (boost::uint32_t)count, 0 };
+        fwrite( &symbols, sizeof(symbols), 1, m_File );
+        for ( size_t key = 0; key < count; ++key ) {
+            std::string name = MessageSymbols::Name( (MessageKey)key );
+            boost::uint32_t entry[2] = { (boost::uint32_t)key, (boost::uint32_t)name.size() };
+            fwrite( entry, sizeof(entry), 1, m_File );
+            fwrite( name.data(), 1, name.size(), m_File );
+        }
+        TraceFileHeader header = { { 'S','E','Q','T','R','A','C','E' }, Version, sizeof(TraceRecord), (boost::uint64_t)offset };
+        if ( fseek( m_File, 0, SEEK_SET ) == 0 ) fwrite( &header, sizeof(header), 1, m_File );
+    }
+
+    void FlushThread()
+    {
+        boost::mutex::scoped_lock lock(m_Lock);
+        while ( !m_Stop ) {
+            m_ConditionVar.timed_wait( lock, boost::posix_time::milliseconds( (long)FlushIntervalMs ) );
+            lock.unlock();
+            DrainAll();
+            lock.lock();
+        }
+    }
+
+public:
+    static bool IsEnabled( int level )
+    {
+        return level <= TraceLevelHolder<0>::s_Level.load( boost::memory_order_relaxed );
+    }
+
+    static void SetLevel( int level )
+    {
+        TraceLevelHolder<0>::s_Level.store( level, boost::memory_order_relaxed );
+    }
+
+    static void Record( int level, int kind, boost::uint32_t key, boost::int32_t arg )
+    {
+        ThreadRing* ringPtr = Instance().GetRing();
+        if ( !ringPtr ) return;
+        ThreadRing& ring = *ringPtr;
+        size_t head = ring.m_Head.load( boost::memory_order_relaxed );
+        if ( head - ring.m_Tail.load( boost::memory_order_acquire ) >= (size_t)RingSize ) {
+            // never block the traced thread
+            ring.m_Dropped.fetch_add( 1, boost::memory_order_relaxed );
+            return;
+        }
+        TraceRecord& record = ring.m_Records[ head % RingSize ];
+        record.m_Time   = boost::chrono::duration_cast< boost::chrono::nanoseconds >( boost::chrono::steady_clock::now().time_since_epoch() ).count();
+        record.m_Thread = ring.m_Thread;
+        record.m_Kind   = (boost::uint16_t)kind;
+        record.m_Level  = (boost::uint16_t)level;
+        record.m_Key    = key;
+        record.m_Arg    = arg;
+        ring.m_Head.store( head + 1, boost::memory_order_release );
+    }
+
+    // starts writing trace records to path; returns false if the file can't be opened
+    static bool Open( const char* path, int level = TRACE_ALL )
+    {
+        Close();
+        Tracer& tracer = Instance();
+        FILE* file = fopen( path, "wb" );
+        if ( !file ) return false;
+
+        TraceFileHeader header = { { 'S','E','Q','T','R','A','C','E' }, Version, sizeof(TraceRecord), 0 };
+        fwrite( &header, sizeof(header), 1, file );
+        {
+            boost::mutex::scoped_lock lock(tracer.m_Lock);
+            tracer.m_File = file;
+            tracer.m_Stop = false;
+        }
+        tracer.m_Flusher.reset( new boost::thread( boost::bind( &Tracer::FlushThread, &tracer ) ) );
+        SetLevel( level );
+        return true;
+    }
+
+    // stops tracing, writes what is still buffered and the key names
+    static void Close()
+    {
+        Tracer& tracer = Instance();
+        SetLevel( TRACE_OFF );
+        if ( !tracer.m_Flusher ) return;
+        {
+            boost::mutex::scoped_lock lock(tracer.m_Lock);
+            tracer.m_Stop = true;
+            tracer.m_ConditionVar.notify_all();
+        }
+        tracer.m_Flusher->join();
+        tracer.m_Flusher.reset();
+        tracer.DrainAll();
+        tracer.WriteSymbols();
+        boost::mutex::scoped_lock lock(tracer.m_Lock);
+        fclose( tracer.m_File );
+        tracer.m_File = NULL;
+        // threads gone since the last drain; from now on RetireRing() drops right away
+        for ( size_t i = tracer.m_Rings.size(); i-- > 0; ) {
+            if ( tracer.m_Rings[i]->m_Retired.load( boost::memory_order_acquire ) ) tracer.DropRing( tracer.m_Rings[i].get() );
+        }
+    }
+
+    // records lost because a thread's ring was full
+    static size_t GetDropped()
+    {
+        Tracer& tracer = Instance();
+        boost::mutex::scoped_lock lock(tracer.m_Lock);
+        size_t dropped( tracer.m_DroppedGone );
+        for ( size_t i = 0; i < tracer.m_Rings.size(); ++i ) {
+            dropped += tracer.m_Rings[i]->m_Dropped.load( boost::memory_order_relaxed );
+        }
+        return dropped;
+    }
+};
+
+/* Reads a trace file written by Tracer, e.g. for a dump tool running in another process:
+ *
+ *     TraceReader reader;
+ *     TraceRecord record;
+ *     if ( reader.Open( "sequencer.trace" ) ) {
+ *         while ( reader.Next( record ) ) printf( "%s\n", reader.GetName( record.m_Key ).c_str() );
+ *     }
+ */
+class TraceReader
+{
+    FILE*                      m_File;
+    // offset of the end of the records
+    boost::uint64_t            m_End;
+    boost::uint64_t            m_Pos;
+    std::vector< std::string > m_Names;
+
+    TraceReader( const TraceReader& );
+    TraceReader& operator=( const TraceReader& );
+
+    bool ReadSymbols( boost::uint64_t offset )
+    {
+        TraceSymbolHeader symbols;
+        if ( fseek( m_File, (long)offset, SEEK_SET ) != 0 || fread( &symbols, sizeof(symbols), 1, m_File ) != 1
+             || std::string( symbols.m_Magic, 8 ) != "SEQSYMBS" ) {
+            return false;
+        }
+        for ( boost::uint32_t i = 0; i < symbols.m_Count; ++i ) {
+            boost::uint32_t entry[2];
+            if ( fread( entry, sizeof(entry), 1, m_File ) != 1 ) return false;
+            std::string name( entry[1], '\0' );
+            if ( entry[1] && fread( &name[0], 1, entry[1], m_File ) != entry[1] ) return false;
+            if ( entry[0] >= m_Names.size() ) m_Names.resize( entry[0] + 1 );
+            m_Names[ entry[0] ] = name;
+        }
+        return true;
+    }
+
+public:
+    TraceReader() : m_File(NULL), m_End(0), m_Pos(0) {}
+
+    ~TraceReader()
+    {
+        Close();
+    }
+
+    /* False if path is not a trace file. A trace that was not closed has its records but no
+     * key names.
+     */
+    bool Open( const char* path )
+    {
+        Close();
+        m_File = fopen( path, "rb" );
+        if ( !m_File ) return false;
+        TraceFileHeader header;
+        if ( fread( &header, sizeof(header), 1, m_File ) != 1 || std::string( header.m_Magic, 8 ) != "SEQTRACE"
+             || header.m_Version != Tracer::Version || header.m_RecordSize != sizeof(TraceRecord) ) {
+            Close();
+            return false;
+        }
+        if ( header.m_SymbolOffset ) {
+            if ( !ReadSymbols( header.m_SymbolOffset ) ) {
+                Close();
+                return false;
+            }
+            m_End = header.m_SymbolOffset;
+        } else {
+            fseek( m_File, 0, SEEK_END );
+            m_End = (boost::uint64_t)ftell( m_File );
+        }
+        m_Pos = sizeof(header);
+        return fseek( m_File, (long)m_Pos, SEEK_SET ) == 0;
+    }
+
+    void Close()
+    {
+        if ( m_File ) fclose( m_File );
+        m_File = NULL;
+        m_Names.clear();
+    }
+
+    // false at the end of the records
+    bool Next( TraceRecord& record )
+    {
+        if ( !m_File || m_Pos + sizeof(record) > m_End || fread( &record, sizeof(record), 1, m_File ) != 1 ) return false;
+        m_Pos += sizeof(record);
+        return true;
+    }
+
+    // name of a record's key as the traced process knew it, empty if not known
+    std::string GetName( boost::uint32_t key ) const
+    {
+        return key < m_Names.size() ? m_Names[key] : std::string();
+    }
+};
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,236 @@
+#ifndef __VALUE_MESSAGE_H__
+#define __VALUE_MESSAGE_H__
+
+#include "message_queue.h"
+
+#include <cstring>
+#include <cstddef>
+#include <new>
+#include <algorithm>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_pod.hpp>
+
+/* Payload type names. A payload type must be a POD and registered once, at global scope:
+ *
+ *     struct Position { float m_X, m_Y; };
+ *     SEQ_PAYLOAD_TYPE( Position, "Position" )
+ *
+ * The name is interned, i.e. payload types are compared as integers like message keys.
+ */
+template<typename T>
+struct PayloadTraits;
+
+#define SEQ_PAYLOAD_TYPE( T, name ) \
+    template<> struct PayloadTraits< T > { static const char* Name() { return name; } };
+
+SEQ_PAYLOAD_TYPE( bool,            "bool" )
+SEQ_PAYLOAD_TYPE( boost::int32_t,  "int32" )
+SEQ_PAYLOAD_TYPE( boost::uint32_t, "uint32" )
+SEQ_PAYLOAD_TYPE( boost::int64_t,  "int64" )
+SEQ_PAYLOAD_TYPE( boost::uint64_t, "uint64" )
+SEQ_PAYLOAD_TYPE( float,           "float" )
+SEQ_PAYLOAD_TYPE( double,          "double" )
+
+template<typename T>
+MessageKey PayloadType()
+{
+    static const MessageKey type = MessageSymbols::Intern( PayloadTraits< T >::Name() );
+    return type;
+}
+
+/* Message with a small POD payload stored inline, the whole message is a single pool
+ * block. Get<T>() checks the payload type by id, no RTTI involved:
+ *
+ *     Position pos = { 1, 2 };
+ *     queue->Send( MessagePtr( new ValueMessage( key, pos ) ) );
+ *     ...
+ *     ValueMessage* vm = msg->Cast<ValueMessage>();
+ *     const Position* pos = vm ? vm->Get<Position>() : NULL;
+ */
+class ValueMessage : public Message
+{
+public:
+    // a pool block of 64 bytes in all
+    enum { InlineSize = 24 };
+
+private:
+    MessageKey      m_PayloadType;
+    boost::uint32_t m_Size;
+    union
+    {
+        char            m_Data[InlineSize];
+        boost::uint64_t m_Align;
+        double          m_AlignDouble;
+    };
+
+public:
+    template<typename T>
+    ValueMessage( MessageKey key, const T& value )
+        : Message( key, Type() )
+        , m_PayloadType( PayloadType< T >() )
+        , m_Size( sizeof(T) )
+    {
+        BOOST_STATIC_ASSERT( boost::is_pod< T >::value );
+        BOOST_STATIC_ASSERT( sizeof(T) <= InlineSize );
+        std::memcpy( m_Data, &value, sizeof(T) );
+    }
+
+    template<typename T>
+    ValueMessage( const char* key, const T& value )
+        : Message( MessageSymbols::Intern(key), Type() )
+        , m_PayloadType( PayloadType< T >() )
+        , m_Size( sizeof(T) )
+    {
+        BOOST_STATIC_ASSERT( boost::is_pod< T >::value );
+        BOOST_STATIC_ASSERT( sizeof(T) <= InlineSize );
+        std::memcpy( m_Data, &value, sizeof(T) );
+    }
+
+    // raw payload of a known type, e.g. decoded; size is clamped to InlineSize
+    ValueMessage( MessageKey key, MessageKey payloadType, const void* data, size_t size )
+        : Message( key, Type() )
+        , m_PayloadType( payloadType )
+        , m_Size( (boost::uint32_t)std::min( size, (size_t)InlineSize ) )
+    {
+        std::memcpy( m_Data, data, m_Size );
+    }
+
+    virtual ~ValueMessage() {}
+
+    static MessageKey Type()
+    {
+        static const MessageKey type = MessageSymbols::Intern("ValueMessage");
+        return type;
+    }
+
+    MessageKey GetPayloadType() const { return m_PayloadType; }
+
+    size_t GetSize() const { return m_Size; }
+
+    const void* GetData() const { return m_Data; }
+
+    // NULL if the payload is not a T, or not the size of one
+    template<typename T>
+    const T* Get() const
+    {
+        return m_PayloadType == PayloadType< T >() && m_Size == sizeof(T) ? reinterpret_cast< const T* >( m_Data ) : NULL;
+    }
+};
+
+class BinaryBuffer;
+typedef boost::intrusive_ptr< BinaryBuffer > BinaryBufferPtr;
+
+/* Reference counted, fixed size byte buffer; header and bytes are one allocation.
+ * Fill it once, then share it read-only through BinaryMessages.
+ */
+class BinaryBuffer
+{
+    mutable boost::atomic<int> m_RefCount;
+    size_t                     m_Size;
+
+    BinaryBuffer( size_t size ) : m_RefCount(0), m_Size(size) {}
+    BinaryBuffer( const BinaryBuffer& );
+    BinaryBuffer& operator=( const BinaryBuffer& );
+
+    static size_t HeaderSize()
+    {
+        // keep the bytes 16 byte aligned
+        return ( sizeof(BinaryBuffer) + 15 ) & ~size_t(15);
+    }
+
+public:
+    static BinaryBufferPtr Create( size_t size )
+    {
+        void* p = ::operator new( HeaderSize() + size );
+        return BinaryBufferPtr( new (p) BinaryBuffer( size ) );
+    }
+
+    static BinaryBufferPtr Create( const void* data, size_t size )
+    {
+        BinaryBufferPtr buffer = Create( size );
+        std::memcpy( buffer->GetData(), data, size );
+        return buffer;
+    }
+
+    char* GetData() { return reinterpret_cast< char* >( this ) + HeaderSize(); }
+
+    const char* GetData() const { return reinterpret_cast< const char* >( this ) + HeaderSize(); }
+
+    size_t GetSize() const { return m_Size; }
+
+    friend void intrusive_ptr_add_ref( const BinaryBuffer* buffer )
+    {
+        buffer->m_RefCount.fetch_add( 1, boost::memory_order_relaxed );
+    }
+
+    friend void intrusive_ptr_release( const BinaryBuffer* buffer )
+    {
+        if ( buffer->m_RefCount.fetch_sub( 1, boost::memory_order_release ) == 1 ) {
+            boost::atomic_thread_fence( boost::memory_order_acquire );
+            buffer->~BinaryBuffer();
+            ::operator delete( const_cast< BinaryBuffer* >( buffer ) );
+        }
+    }
+};
+
+/* Message viewing a range of a shared BinaryBuffer. Sending, forwarding or slicing it
+ * never copies the bytes. The payload type is optional (0), e.g. an interned content type.
+ */
+class BinaryMessage : public Message
+{
+    BinaryBufferPtr m_Buffer;
+    size_t          m_Offset;
+    size_t          m_Size;
+    MessageKey      m_PayloadType;
+
+public:
+    BinaryMessage( MessageKey key, const BinaryBufferPtr& buffer, MessageKey payloadType = 0 )
+        : Message( key, Type() )
+        , m_Buffer(buffer)
+        , m_Offset(0)
+        , m_Size( buffer ? buffer->GetSize() : 0 )
+        , m_PayloadType(payloadType)
+    {}
+
+    // offset and size are clamped to the buffer
+    BinaryMessage( MessageKey key, const BinaryBufferPtr& buffer, size_t offset, size_t size, MessageKey payloadType = 0 )
+        : Message( key, Type() )
+        , m_Buffer(buffer)
+        , m_Offset(0)
+        , m_Size(0)
+        , m_PayloadType(payloadType)
+    {
+        size_t total = buffer ? buffer->GetSize() : 0;
+        m_Offset = std::min( offset, total );
+        m_Size   = std::min( size, total - m_Offset );
+    }
+
+    virtual ~BinaryMessage() {}
+
+    static MessageKey Type()
+    {
+        static const MessageKey type = MessageSymbols::Intern("BinaryMessage");
+        return type;
+    }
+
+    MessageKey GetPayloadType() const { return m_PayloadType; }
+
+    const BinaryBufferPtr& GetBuffer() const { return m_Buffer; }
+
+    const char* GetData() const { return m_Buffer ? m_Buffer->GetData() + m_Offset : NULL; }
+
+    size_t GetSize() const { return m_Size; }
+
+    // a view of part of this message's bytes, relative to its own offset
+    MessagePtr Slice( MessageKey key, size_t offset, size_t size ) const
+    {
+        offset = std::min( offset, m_Size );
+        return MessagePtr( new BinaryMessage( key, m_Buffer, m_Offset + offset, std::min( size, m_Size - offset ), m_PayloadType ) );
+    }
+};
+
+#endif /* __VALUE_MESSAGE_H__ */